@@ -0,0 +1,42 @@
+// Multi-link bonding header.
+
+#ifndef _BONDING_H_
+#define _BONDING_H_
+
+#include "link_layer_ctx.h"
+
+#include <sys/uio.h>
+
+// Most serial ports one transfer can be striped across
+#define BOND_MAX_LINKS 8
+
+// Open one link per serial port, in port order, each with the parameters in
+// connectionParameters and the options set with llsetoptions. With a single
+// port this is just llopen; with more, every link runs in a child process and
+// both sides must list their ports in matching pairs.
+// Return number of links on success or "-1" on error.
+int bondopen(LinkLayer connectionParameters, const char *serialPorts[], int nPorts);
+
+// Send one packet on the next idle link. Faster links go idle sooner and so
+// carry more packets.
+// Return number of chars written, or "-1" on error.
+int bondwrite(const unsigned char *buf, int bufSize);
+int bondwritev(const struct iovec *iov, int iovcnt);
+
+// Largest packet bondwrite accepts and bondread returns, the smallest of the
+// links' llmaxpayload().
+int bondmaxpayload();
+
+// Packet size suggested by the link the next bondwrite goes to (see
+// llpreferredpayload). Waits for a link to go idle.
+int bondpreferredpayload();
+
+// Receive the next packet, in the order the packets were written.
+// Return number of chars read, or "-1" on error.
+int bondread(unsigned char *packet);
+
+// Close all links, printing the statistics of each as llclose does.
+// Return "1" on success or "-1" on error.
+int bondclose(int showStatistics);
+
+#endif // _BONDING_H_
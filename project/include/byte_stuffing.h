@@ -0,0 +1,28 @@
+// Byte stuffing header.
+
+#ifndef _BYTE_STUFFING_H_
+#define _BYTE_STUFFING_H_
+
+#include "link_layer_ctx.h"
+
+#define FLAG 0x7E
+#define ESC 0x7D
+
+// Stuff size bytes of data into out (at most 2 * size bytes). If fcs isn't
+// NULL, the data is added to the running frame check of the given type in
+// the same pass.
+// Returns the number of bytes written.
+int stuffBytes(const unsigned char *data, int size, unsigned char *out, LinkLayerFcs type, unsigned int *fcs);
+
+// Destuff received bytes into out, stopping at the first FLAG or at the end
+// of data. *escPending carries an ESC split across calls. If fcs isn't NULL,
+// the destuffed bytes are added to the running frame check in the same pass.
+// Returns the number of bytes consumed (a FLAG is not consumed) and stores
+// the number of bytes written in *outSize.
+int destuffBytes(const unsigned char *data, int size, unsigned char *out, int *outSize,
+                 int *escPending, LinkLayerFcs type, unsigned int *fcs);
+
+// Index of the first FLAG or ESC in data, or size if there is none.
+int findSpecialByte(const unsigned char *data, int size);
+
+#endif // _BYTE_STUFFING_H_
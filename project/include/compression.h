@@ -0,0 +1,19 @@
+// Packet compression header.
+
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+// Codecs announced in the START packet
+#define CODEC_NONE 0x00
+#define CODEC_LZ 0x01 // LZ4 block format, one block per data packet
+
+// Compress size bytes of data into out (LZ4 block format).
+// Returns the compressed size, or -1 if it doesn't fit in outCapacity bytes.
+int lzCompress(const unsigned char *data, int size, unsigned char *out, int outCapacity);
+
+// Decompress a block of size bytes into out.
+// Returns the decompressed size, or -1 if the block is malformed or doesn't
+// fit in outCapacity bytes.
+int lzDecompress(const unsigned char *data, int size, unsigned char *out, int outCapacity);
+
+#endif // _COMPRESSION_H_
@@ -0,0 +1,49 @@
+// Frame deframer header.
+
+#ifndef _DEFRAMER_H_
+#define _DEFRAMER_H_
+
+#include "link_layer_ctx.h"
+
+// Receiver states, kept between chunks so a frame can span several reads
+typedef enum
+{
+    START_STATE, // Hunting for a FLAG
+    FLAG_RCV,
+    A_RCV,
+    C_RCV,
+    INFO_STATE, // Destuffing the body until the closing FLAG
+    STOP_STATE  // A complete frame is ready
+} StateType;
+
+typedef struct
+{
+    StateType currentState;
+    unsigned char address;
+    unsigned char control;
+    unsigned char *body; // Destuffed bytes between BCC1 and the closing FLAG
+    int bodySize;
+    int capacity;
+    int escPending;
+    LinkLayerFcs fcsType;
+    int checkFcs;     // FALSE when the body must be repaired before its check
+    unsigned int fcs; // Running frame check of the body
+} Deframer;
+
+// Set up a deframer that destuffs frame bodies of up to capacity bytes into
+// body, computing the given frame check on the way.
+void deframerInit(Deframer *d, unsigned char *body, int capacity, LinkLayerFcs fcsType);
+
+// Consume received bytes until a frame is complete (currentState is
+// STOP_STATE) or the data runs out. Frames whose header fails BCC1 or whose
+// body overflows are dropped. Returns the number of bytes consumed.
+int deframerPush(Deframer *d, const unsigned char *data, int size);
+
+// Start on the next frame once a complete one was handled. The closing FLAG
+// of the last frame may also open the next one.
+void deframerNext(Deframer *d);
+
+// TRUE if the body of the complete frame ends with a correct frame check.
+int deframerCheck(const Deframer *d);
+
+#endif // _DEFRAMER_H_
@@ -0,0 +1,31 @@
+// Frame check sequence (BCC2) header.
+
+#ifndef _FRAME_CHECK_H_
+#define _FRAME_CHECK_H_
+
+#include "link_layer_ctx.h"
+
+// Largest frame check sequence, in bytes.
+#define MAX_FCS_SIZE 4
+
+// Size in bytes of the frame check sequence.
+int fcsSize(LinkLayerFcs type);
+
+// Initial value of a running frame check.
+unsigned int fcsInit(LinkLayerFcs type);
+
+// Add size bytes of data to a running frame check.
+unsigned int fcsUpdate(LinkLayerFcs type, unsigned int fcs, const unsigned char *data, int size);
+
+// Add a single byte to a running frame check.
+unsigned int fcsUpdateByte(LinkLayerFcs type, unsigned int fcs, unsigned char byte);
+
+// Write the frame check sequence to out, in transmission order.
+void fcsFinal(LinkLayerFcs type, unsigned int fcs, unsigned char *out);
+
+// Check a running frame check fed with the data followed by its received
+// frame check sequence.
+// Returns TRUE if the frame is correct.
+int fcsCheck(LinkLayerFcs type, unsigned int fcs);
+
+#endif // _FRAME_CHECK_H_
@@ -0,0 +1,231 @@
+// Link layer extensions header.
+// The provided link_layer.h declares the base llopen, llwrite, llread and
+// llclose and is left as it was; the optional features built on them are
+// declared here.
+
+#ifndef _LINK_LAYER_CTX_H_
+#define _LINK_LAYER_CTX_H_
+
+#include "link_layer.h"
+
+#include <sys/uio.h>
+
+// Largest payload that can be negotiated in llopen (16-bit parameter)
+#define MAX_NEGOTIATED_PAYLOAD_SIZE 65535
+
+// Maximum number of unacknowledged I-frames (sequence numbers are modulo 8)
+#define MAX_WINDOW_SIZE 7
+// Selective Repeat needs the window to be at most half the sequence space
+#define MAX_SELECTIVE_WINDOW_SIZE 4
+
+// Logical channels one link can carry (the channel goes in two bits of the
+// address byte)
+#define LL_MAX_CHANNELS 4
+
+// Automatic repeat request mode negotiated by llopen.
+typedef enum
+{
+    LlStopAndWait,
+    LlGoBackN,
+    LlSelectiveRepeat,
+} LinkLayerArq;
+
+// Frame check sequence (BCC2) negotiated by llopen.
+typedef enum
+{
+    LlFcsXor,    // One-byte XOR of the data
+    LlFcsCrc16,  // CRC-16-CCITT
+    LlFcsCrc32c, // CRC-32C (Castagnoli)
+} LinkLayerFcs;
+
+// Format of the link's telemetry file.
+typedef enum
+{
+    LlMetricsJson,
+    LlMetricsPrometheus, // Text exposition format
+} LinkLayerMetricsFormat;
+
+// Optional protocol features. The transmitter proposes them in SET and the
+// receiver answers in UA with the values both sides will use.
+typedef struct
+{
+    LinkLayerArq arq;
+    int windowSize; // Frames in flight (1 to MAX_WINDOW_SIZE)
+    LinkLayerFcs fcs;
+    // Largest I-frame payload (MAX_PAYLOAD_SIZE to MAX_NEGOTIATED_PAYLOAD_SIZE).
+    // The receiver agrees to at most its own value.
+    int maxPayloadSize;
+    // Reed-Solomon parity bytes per 255-byte block of the I-frame body, 0 for
+    // none (32 gives RS(255,223)). The receiver accepts what is proposed.
+    int fecParity;
+    // Local serial read timing, not negotiated (see termios(3))
+    int readMinBytes; // VMIN
+    int readTimeout;  // VTIME, in tenths of a second
+
+    // Local retransmission timeout in microseconds, 0 uses LinkLayer.timeout.
+    // It is only the initial value unless fixedTimeout is set: the link then
+    // follows the measured round-trip time.
+    long timeoutMicros;
+    int fixedTimeout;
+
+    // The transmitter adapts the suggested payload size (llpreferredpayload)
+    // to the observed error rate. Local, not negotiated.
+    int adaptivePayload;
+
+    // Both sides send I-frames, each acknowledging the other side's in the
+    // N(R) of its own. Needs the sliding window: stop-and-wait becomes
+    // Go-Back-N with a window of one frame. Agreed only if both sides ask.
+    int duplex;
+
+    // Logical channels (1 to LL_MAX_CHANNELS), each with its own sequence
+    // numbers, window and stream of packets. Their I-frames take turns on the
+    // line. Needs the sliding window like duplex. The receiver agrees to at
+    // most its own value.
+    int channels;
+
+    // A thread of the link owns the serial port, the framing, the ARQ and
+    // the timers, and llwrite and llread only hand packets to it and take
+    // them back, so they rarely wait for the line. Needs the sliding window
+    // and a single channel; local, not negotiated. llwrite then returns the
+    // size of the packet, since its frame is only built once the thread
+    // takes it.
+    int ioThread;
+
+    // Resuming an interrupted transfer. The transmitter proposes the
+    // fingerprint of its file and the offset it resumes from, the receiver
+    // those of the file it holds, and llopen agrees the smaller offset if the
+    // fingerprints match, 0 otherwise (see llresumeoffset). A fingerprint of
+    // 0 resumes nothing.
+    unsigned int resumeFingerprint;
+    int resumeOffset;
+
+    // Seconds a lost link is probed for once the retry limit is reached,
+    // resuming the transfer where it stopped if it comes back. 0 ends the
+    // process at the retry limit. Local, not negotiated.
+    int reconnectSeconds;
+
+    // Telemetry written to metricsFile (NULL for none) by llclose and, if
+    // metricsIntervalMicros is not 0, that often during the transfer.
+    // Local, not negotiated.
+    const char *metricsFile;
+    LinkLayerMetricsFormat metricsFormat;
+    long metricsIntervalMicros;
+} LinkLayerOptions;
+
+// The options of the base stop-and-wait protocol, to start from.
+LinkLayerOptions lldefaultoptions();
+
+// Set the optional features used by the next llopen. Without this call the
+// link runs the base stop-and-wait protocol.
+void llsetoptions(LinkLayerOptions options);
+
+// Send the concatenation of iovcnt buffers as one I-frame. The data is
+// stuffed straight from the buffers into the frame, without assembling the
+// packet first.
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *iov, int iovcnt);
+
+// Largest payload llwrite accepts and llread returns on the open link, as
+// agreed in llopen. The packet buffer given to llread must be this big.
+int llmaxpayload();
+
+// Payload size the application should use for its next llwrite, at most
+// llmaxpayload(). With adaptivePayload it follows the error rate of the line.
+int llpreferredpayload();
+
+// TRUE if llopen agreed a duplex link, so both sides may call llwrite and
+// llread. Each side must keep calling llread while the other is sending:
+// I-frames not read yet hold the receive buffers.
+int llduplex();
+
+// File offset llopen agreed to resume the transfer from, 0 to start over.
+int llresumeoffset();
+
+// Number of logical channels agreed by llopen. llwrite and llread use
+// channel 0; the functions below take the channel, from 0 to llchannels() - 1.
+// While one channel is read the others keep receiving, but frames not read
+// yet hold the receive buffers of their own channel only.
+int llchannels();
+int llwritechannel(int channel, const unsigned char *buf, int bufSize);
+int llwritevchannel(int channel, const struct iovec *iov, int iovcnt);
+int llreadchannel(int channel, unsigned char *packet);
+
+// Receive the next packet of whichever channel has one first, taking the
+// channels in turn. The channel is stored in *channel.
+// Return number of chars read, or "-1" on error.
+int llreadany(int *channel, unsigned char *packet);
+
+// Asynchronous requests, for callers driven by their own event loop. They
+// need the sliding window (stop-and-wait links refuse them). Once a link has
+// taken one, received I-frames wait for a read as on a duplex link, and a
+// channel should not also be used with the blocking calls.
+
+// Called when an asynchronous request completes, with what the blocking call
+// would have returned (the I-frame size or the packet size, -1 if the link
+// closed first) and the userData given with the request.
+typedef void (*LinkLayerCallback)(int result, void *userData);
+
+// Requests of each kind (writes, reads) one channel can have pending
+#define LL_MAX_ASYNC_REQUESTS 8
+
+// Queue buf to be sent on channel 0 and return at once. The callback is
+// called by llpump once its I-frame is acknowledged; buf must be left
+// untouched until then.
+// Return "1" if queued or "-1" on error.
+int llwrite_async(const unsigned char *buf, int bufSize, LinkLayerCallback done, void *userData);
+
+// Queue packet (llmaxpayload() bytes) for the next packet received on
+// channel 0. The callback is called by llpump once it is there.
+// Return "1" if queued or "-1" on error.
+int llread_async(unsigned char *packet, LinkLayerCallback done, void *userData);
+
+// Descriptor, for poll or epoll, that becomes readable when llpump has work:
+// bytes received, a timer expired or a request was queued.
+// Return "-1" on error.
+int llpollfd();
+
+// Do what the link can without blocking and call the callbacks of the
+// requests that completed. Callbacks may queue new requests, but must not
+// close the link.
+// Return the number of completed requests, or "-1" on error.
+int llpump();
+
+// Handle of one connection. llopen, llwrite, llread, llclose and the functions
+// above work on a default one; the ones below keep all the state of each
+// connection in its own handle, so a process can run several links, each
+// driven by its own thread.
+typedef struct LinkLayerCtx LinkLayerCtx;
+
+// Links ll_open_ctx can have open at once when built with LL_NO_HEAP
+#define LL_MAX_CONTEXTS 4
+
+// Open a connection with the given options (NULL for the base protocol).
+// Return the handle, or NULL on error.
+LinkLayerCtx *ll_open_ctx(LinkLayer connectionParameters, const LinkLayerOptions *options);
+
+// llwrite, llwritev, llmaxpayload, llpreferredpayload, llduplex,
+// llresumeoffset, llread and the channel functions on a handle
+int ll_write_ctx(LinkLayerCtx *ctx, const unsigned char *buf, int bufSize);
+int ll_writev_ctx(LinkLayerCtx *ctx, const struct iovec *iov, int iovcnt);
+int ll_maxpayload_ctx(LinkLayerCtx *ctx);
+int ll_preferredpayload_ctx(LinkLayerCtx *ctx);
+int ll_duplex_ctx(LinkLayerCtx *ctx);
+int ll_resume_offset_ctx(LinkLayerCtx *ctx);
+int ll_read_ctx(LinkLayerCtx *ctx, unsigned char *packet);
+int ll_channels_ctx(LinkLayerCtx *ctx);
+int ll_write_channel_ctx(LinkLayerCtx *ctx, int channel, const unsigned char *buf, int bufSize);
+int ll_writev_channel_ctx(LinkLayerCtx *ctx, int channel, const struct iovec *iov, int iovcnt);
+int ll_read_channel_ctx(LinkLayerCtx *ctx, int channel, unsigned char *packet);
+int ll_read_any_ctx(LinkLayerCtx *ctx, int *channel, unsigned char *packet);
+
+// The asynchronous functions on a handle, the requests on any channel
+int ll_write_async_ctx(LinkLayerCtx *ctx, int channel, const unsigned char *buf, int bufSize, LinkLayerCallback done, void *userData);
+int ll_read_async_ctx(LinkLayerCtx *ctx, int channel, unsigned char *packet, LinkLayerCallback done, void *userData);
+int ll_poll_fd_ctx(LinkLayerCtx *ctx);
+int ll_pump_ctx(LinkLayerCtx *ctx);
+
+// Close the connection and free the handle.
+// Return "1" on success or "-1" on error.
+int ll_close_ctx(LinkLayerCtx *ctx, int showStatistics);
+
+#endif // _LINK_LAYER_CTX_H_
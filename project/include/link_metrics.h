@@ -0,0 +1,61 @@
+// Link telemetry header.
+
+#ifndef _LINK_METRICS_H_
+#define _LINK_METRICS_H_
+
+#include "link_layer_ctx.h"
+
+// Send-to-acknowledgment latency buckets, plus one for the slower frames
+#define LATENCY_BUCKETS 16
+
+// Upper bound of each latency bucket, in microseconds
+extern const long latencyBucketBounds[LATENCY_BUCKETS];
+
+typedef struct
+{
+    long counts[LATENCY_BUCKETS + 1]; // Frames in each bucket (not cumulative)
+    long count;
+    long sumMicros;
+} LatencyHistogram;
+
+// Add one latency, in microseconds.
+void histogramAdd(LatencyHistogram *histogram, long micros);
+
+// Snapshot of a link's counters, taken by the link layer
+typedef struct
+{
+    const char *role; // "tx" or "rx"
+    const char *port;
+    int final;        // Taken by llclose, otherwise during the transfer
+    double elapsedSeconds;
+    int baudRate;
+
+    long framesSent;          // I-frames, retransmissions included
+    long framesReceived;
+    long framesRetransmitted;
+    long errorFrames;
+    long timeouts;
+    long rejectsReceived;
+    long selectiveRejects;
+    int outages;
+    double downtimeSeconds;
+
+    long wireBytesSent;     // Everything written to the serial port
+    long wireBytesReceived; // Everything read from it
+    long payloadBytesSent;  // Of the I-frames acknowledged
+    long payloadBytesReceived;
+    long frameBytes;        // I-frames before stuffing, first transmissions
+    long stuffedFrameBytes; // The same once stuffed
+    long newFramesSent;     // First transmissions
+
+    double srttSeconds; // 0 before the first sample
+    LatencyHistogram ackLatency;
+} LinkMetrics;
+
+// Write the snapshot to path as JSON or Prometheus text, replacing the file
+// at once so a reader never sees half of it. Goodput, efficiency and the
+// stuffing overhead are derived from the counters.
+// Returns -1 on error.
+int writeMetrics(const char *path, LinkLayerMetricsFormat format, const LinkMetrics *metrics);
+
+#endif // _LINK_METRICS_H_
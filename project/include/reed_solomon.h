@@ -0,0 +1,34 @@
+// Reed-Solomon forward error correction header.
+
+#ifndef _REED_SOLOMON_H_
+#define _REED_SOLOMON_H_
+
+#include "link_layer_ctx.h"
+
+// Codewords are at most 255 bytes: data followed by its parity. A frame body
+// is split into blocks of FEC_BLOCK_SIZE - parity data bytes, the last one
+// shortened.
+#define FEC_BLOCK_SIZE 255
+#define MAX_FEC_PARITY 64
+
+// Size of a body of size bytes once every block carries its parity.
+#define FEC_ENCODED_SIZE(size, parity) \
+    ((size) + (parity) * (((size) + FEC_BLOCK_SIZE - (parity) - 1) / (FEC_BLOCK_SIZE - (parity))))
+
+// Add size data bytes to a running encoder. parity holds the nParity parity
+// bytes of the block so far and must start zeroed; once the block's data is
+// all added, it holds the parity to send after it.
+void rsEncodeUpdate(unsigned char *parity, int nParity, const unsigned char *data, int size);
+
+// Correct a block of size bytes (data followed by nParity parity bytes) in
+// place. Up to nParity / 2 damaged bytes can be repaired.
+// Returns the number of bytes corrected, or -1 if the block can't be repaired.
+int rsDecode(unsigned char *block, int size, int nParity);
+
+// Correct every block of a received body in place and pack the data to the
+// front, dropping the parity. The number of bytes corrected is added to
+// *corrected.
+// Returns the data size, or -1 if a block can't be repaired.
+int fecDecode(unsigned char *body, int size, int nParity, int *corrected);
+
+#endif // _REED_SOLOMON_H_
@@ -0,0 +1,67 @@
+// Serial port extensions header.
+// The provided serial_port.h is left as it was; what the link layer needs
+// beyond it is declared here.
+
+#ifndef _SERIAL_PORT_CTX_H_
+#define _SERIAL_PORT_CTX_H_
+
+#include "serial_port.h"
+
+#include <termios.h>
+
+// Receive ring buffer size, must be a power of two
+#define RX_RING_SIZE 4096
+
+// Bits the line takes per byte as the port is set up (8N1): start bit, 8 data
+// bits and stop bit
+#define LINE_BITS_PER_BYTE 10
+
+// State of one open serial port. The functions taking a SerialPort touch
+// nothing else, so different ports can be used from different threads; the
+// ones without it use a default port, whose received bytes also go through
+// the ring buffer (see readByteSerialPort).
+typedef struct
+{
+    int fd;                // File descriptor of the open port
+    struct termios oldtio; // Port settings to restore on closing
+    // Receive ring buffer. The indexes run freely and are masked on access.
+    unsigned char rxRing[RX_RING_SIZE];
+    unsigned int rxHead; // Next byte to hand out
+    unsigned int rxTail; // Next free position
+} SerialPort;
+
+// Read up to maxBytes received bytes, waiting as configured by VMIN/VTIME only
+// when the receive ring buffer is empty.
+// Returns -1 on error, otherwise the number of bytes read.
+int readBytesSerialPort(unsigned char *buf, int maxBytes);
+
+// Change the read timing: a read that finds the ring buffer empty waits for
+// vmin bytes, or vtime tenths of a second (see termios(3)).
+// Returns -1 on error.
+int setReadTimingSerialPort(int vmin, int vtime);
+
+// Events reported by waitSerialPort
+#define SERIAL_READABLE 0x01
+#define SERIAL_EVENT 0x02
+#define SERIAL_HANGUP 0x04 // The port hung up or failed; reads return what is left, then 0
+
+// Block until received bytes are available or eventFd (ignored if -1)
+// becomes readable, so a timer or other descriptor can wake the caller.
+// Returns -1 on error, otherwise a mask of the SERIAL_ events.
+int waitSerialPort(int eventFd);
+
+// Same as waitSerialPort, but returns at once with the events already there
+// (0 if none), for callers driven by their own event loop.
+int pollSerialPort(int eventFd);
+
+// The functions of serial_port.h and the ones above on a given port
+int openSerialPortCtx(SerialPort *port, const char *serialPort, int baudRate);
+int closeSerialPortCtx(SerialPort *port);
+int readByteSerialPortCtx(SerialPort *port, unsigned char *byte);
+int readBytesSerialPortCtx(SerialPort *port, unsigned char *buf, int maxBytes);
+int setReadTimingSerialPortCtx(SerialPort *port, int vmin, int vtime);
+int waitSerialPortCtx(SerialPort *port, int eventFd);
+int pollSerialPortCtx(SerialPort *port, int eventFd);
+int writeBytesSerialPortCtx(SerialPort *port, const unsigned char *bytes, int numBytes);
+
+#endif // _SERIAL_PORT_CTX_H_
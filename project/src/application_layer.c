@@ -1,18 +1,56 @@
 // Application layer protocol implementation
 
 #include "application_layer.h"
-#include "link_layer.h"
+#include "bonding.h"
+#include "compression.h"
+#include "frame_check.h"
+#include "link_layer_ctx.h"
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 
-#define MAX_PACKET_SIZE 500 // Tamanho máximo do packet (por decidir)
+#define MAX_PACKET_SIZE 500 // Tamanho por omissão dos dados de um packet (RCOM_PACKET_SIZE)
+#define MAX_DATA_SIZE 65535 // Limit of the 16-bit length field of data packets
+#define DATA_HEADER_SIZE 4
+// Bytes of a mapped file asked from the disk ahead of the packet being sent
+#define READ_AHEAD_SIZE (256 * 1024)
+// Received data gathered before each write to the file, at least one packet
+#define WRITE_BEHIND_SIZE (256 * 1024)
+// Channel 0 carries the file of the command line, channel 1 RCOM_CHANNEL_FILE
+#define FILE_CHANNELS 2
+// Journal of a resumable transfer (RCOM_RESUME), kept next to the file
+#define JOURNAL_SUFFIX ".journal"
+// File bytes sent or received between two updates of a journal
+#define JOURNAL_INTERVAL (64 * 1024)
+
+// Packet types
+#define PACKET_START 0x01
+#define PACKET_DATA 0x02
+#define PACKET_END 0x03
+#define PACKET_COMPRESSED_DATA 0x04 // Data packet holding one compressed block
+
+// START packet TLVs
+#define TLV_FILE_SIZE 0x00
+#define TLV_FILE_NAME 0x01
+#define TLV_CODEC 0x02         // Codec of the compressed data packets
+#define TLV_MAX_DATA_SIZE 0x03 // Largest data packet once decompressed
+#define TLV_FINGERPRINT 0x04   // Of the file, for the receiver's journal
 
 time_t start, end;
 
-// Used to signal START and END of file transfer
-void createControlPacket(unsigned char *packet, int *packetSize, unsigned char controlType, int fileSize, const char *fileName)
+// Transfer statistics, printed after llclose
+struct timespec transferStart;
+long fileBytes = 0;    // Bytes read from or written to the file
+long payloadBytes = 0; // Data packet payload bytes sent or received
+
+// Used to signal START and END of file transfer. Without compression the
+// packet is the same as the base protocol's.
+void createControlPacket(unsigned char *packet, int *packetSize, unsigned char controlType, int fileSize, const char *fileName,
+                         unsigned char codec, int maxDataSize, unsigned int fingerprint)
 {
     packet[0] = controlType;
     packet[1] = 0x00;
@@ -29,130 +67,853 @@ void createControlPacket(unsigned char *packet, int *packetSize, unsigned char c
     }
     else
         *packetSize = 7;
+
+    if (codec != CODEC_NONE)
+    {
+        packet[*packetSize] = TLV_CODEC;
+        packet[*packetSize + 1] = 1;
+        packet[*packetSize + 2] = codec;
+        packet[*packetSize + 3] = TLV_MAX_DATA_SIZE;
+        packet[*packetSize + 4] = 2;
+        packet[*packetSize + 5] = (maxDataSize >> 8) & 0xFF;
+        packet[*packetSize + 6] = maxDataSize & 0xFF;
+        *packetSize += 7;
+    }
+
+    if (fingerprint != 0)
+    {
+        packet[*packetSize] = TLV_FINGERPRINT;
+        packet[*packetSize + 1] = sizeof(int);
+        memcpy(&packet[*packetSize + 2], &fingerprint, sizeof(int));
+        *packetSize += 2 + sizeof(int);
+    }
 }
 
-void createDataPacket(unsigned char *packet, int *packetSize, int sequenceNumber, unsigned char *data, int dataSize)
+// Reads the TLVs of a START packet; unknown ones are skipped
+void parseControlPacket(const unsigned char *packet, int packetSize, int *fileSize, unsigned char *codec, int *maxDataSize,
+                        unsigned int *fingerprint)
 {
-    packet[0] = 0x02;
-    packet[1] = sequenceNumber;
-    packet[2] = (dataSize >> 8) & 0xFF;
-    packet[3] = dataSize & 0xFF;
-    memcpy(&packet[4], data, dataSize);
-    *packetSize = 4 + dataSize;
+    int i = 1;
+    while (i + 2 <= packetSize && i + 2 + packet[i + 1] <= packetSize)
+    {
+        unsigned char type = packet[i];
+        unsigned char length = packet[i + 1];
+        const unsigned char *value = &packet[i + 2];
+
+        if (type == TLV_FILE_SIZE && length == sizeof(int))
+            memcpy(fileSize, value, sizeof(int));
+        else if (type == TLV_CODEC && length == 1)
+            *codec = value[0];
+        else if (type == TLV_MAX_DATA_SIZE && length == 2)
+            *maxDataSize = (value[0] << 8) | value[1];
+        else if (type == TLV_FINGERPRINT && length == sizeof(int))
+            memcpy(fingerprint, value, sizeof(int));
+        i += 2 + length;
+    }
 }
 
-void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename)
+// Header of a data packet, sent in front of the data with llwritev so the
+// data is never copied into a packet buffer
+void createDataPacketHeader(unsigned char *header, unsigned char packetType, int sequenceNumber, int dataSize)
 {
-    time(&start);  // Get the current time
-    
-    LinkLayer connectionParameters;
+    header[0] = packetType;
+    header[1] = sequenceNumber;
+    header[2] = (dataSize >> 8) & 0xFF;
+    header[3] = dataSize & 0xFF;
+}
 
-    strcpy(connectionParameters.serialPort, serialPort);
-    connectionParameters.baudRate = baudRate;
-    connectionParameters.nRetransmissions = nTries;
-    connectionParameters.timeout = timeout;
-    connectionParameters.role = strcmp(role, "tx") ? LlRx : LlTx;
+// File bytes sent in each data packet (RCOM_PACKET_SIZE, default MAX_PACKET_SIZE)
+int loadPacketSize()
+{
+    const char *packetSize = getenv("RCOM_PACKET_SIZE");
+    int size = packetSize != NULL ? atoi(packetSize) : MAX_PACKET_SIZE;
+    if (size < 1)
+        size = MAX_PACKET_SIZE;
+    if (size > MAX_DATA_SIZE)
+        size = MAX_DATA_SIZE;
+    return size;
+}
 
-    printf("--------------LLOPEN--------------\n");
-    // Call llopen to initialize the link layer connection
-    if (llopen(connectionParameters) < 0)
-    {
-        printf("ERROR: Failed to open link layer connection.\n");
-        return;
-    }
+// Codec for the data packets (RCOM_COMPRESS=lz), none by default
+unsigned char loadCodec()
+{
+    const char *codec = getenv("RCOM_COMPRESS");
+    if (codec != NULL && strcmp(codec, "lz") == 0)
+        return CODEC_LZ;
+    return CODEC_NONE;
+}
+
+// Serial ports to bond: the one from the command line followed by the
+// comma-separated RCOM_BOND_PORTS, paired in order with the other side's.
+// Returns the number of ports.
+int loadSerialPorts(const char *serialPort, const char *serialPorts[], char *bondPorts)
+{
+    int nPorts = 0;
+    serialPorts[nPorts++] = serialPort;
 
-    FILE *file = NULL;
+    const char *ports = getenv("RCOM_BOND_PORTS");
+    if (ports == NULL)
+        return nPorts;
+    strncpy(bondPorts, ports, 999);
+    bondPorts[999] = '\0';
+    for (char *port = strtok(bondPorts, ","); port != NULL && nPorts < BOND_MAX_LINKS; port = strtok(NULL, ","))
+        serialPorts[nPorts++] = port;
+    return nPorts;
+}
+
+////////////////////////////////////////////////
+// Resumable transfers
+////////////////////////////////////////////////
 
-    // If the role is LlTx, send data
-    if (connectionParameters.role == LlTx)
+// With RCOM_RESUME each side keeps a journal next to its file: the file's
+// fingerprint and the offset the transfer got to. The transmitter's counts
+// the data it handed to the link, the receiver's only the data already on
+// its disk. llopen resumes from the smaller one when the fingerprints match.
+
+void journalPath(char *path, const char *fileName)
+{
+    snprintf(path, 1024, "%s%s", fileName, JOURNAL_SUFFIX);
+}
+
+// Reads the journal of the file.
+// Returns -1 if there is none.
+int loadJournal(const char *fileName, unsigned int *fingerprint, int *offset)
+{
+    char path[1024];
+    journalPath(path, fileName);
+    FILE *journal = fopen(path, "r");
+    if (journal == NULL)
+        return -1;
+    int fields = fscanf(journal, "%x %d", fingerprint, offset);
+    fclose(journal);
+    return fields == 2 ? 1 : -1;
+}
+
+// Records how far the transfer of the file got, opening the journal the
+// first time
+void saveJournal(FILE **journal, const char *fileName, unsigned int fingerprint, long offset)
+{
+    if (*journal == NULL)
     {
-        printf("--------------LLWRITE--------------\n");
-        file = fopen(filename, "rb");
-        if (!file)
+        char path[1024];
+        journalPath(path, fileName);
+        *journal = fopen(path, "w");
+        if (*journal == NULL)
         {
-            printf("ERROR: Failed to open file.\n");
-            llclose(1);
+            perror("journal");
             return;
         }
+    }
+    // Fixed width, so each record overwrites the last one
+    rewind(*journal);
+    fprintf(*journal, "%08x %010ld\n", fingerprint, offset);
+    fflush(*journal);
+}
+
+// The transfer of the file is complete, nothing is left to resume
+void removeJournal(FILE **journal, const char *fileName)
+{
+    char path[1024];
+    journalPath(path, fileName);
+    if (*journal != NULL)
+        fclose(*journal);
+    *journal = NULL;
+    remove(path);
+}
+
+// CRC-32C of the contents and size of the file, never 0.
+// Returns 0 if the file can't be read.
+unsigned int fileFingerprint(const char *fileName)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (file == NULL)
+        return 0;
+    unsigned char buffer[64 * 1024];
+    unsigned int fcs = fcsInit(LlFcsCrc32c);
+    long size = 0;
+    size_t bytes;
+    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        fcs = fcsUpdate(LlFcsCrc32c, fcs, buffer, bytes);
+        size += bytes;
+    }
+    fclose(file);
+    fcs = fcsUpdate(LlFcsCrc32c, fcs, (const unsigned char *)&size, sizeof(size));
+    return fcs != 0 ? fcs : 1;
+}
+
+// Resumable transfers (RCOM_RESUME=1), off by default
+int loadResume()
+{
+    const char *resume = getenv("RCOM_RESUME");
+    return resume != NULL && atoi(resume);
+}
+
+void printTransferStatistics(unsigned char codec)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - transferStart.tv_sec) + (now.tv_nsec - transferStart.tv_nsec) / 1e9;
 
-        // Get the size of the file
-        fseek(file, 0, SEEK_END);
-        int fileSize = ftell(file);
-        fseek(file, 0, SEEK_SET);
+    printf("---- Transfer ----\n");
+    printf("File Bytes: %ld\n", fileBytes);
+    if (codec != CODEC_NONE)
+        printf("Compression Ratio: %.2f (%ld bytes on the link)\n",
+               payloadBytes > 0 ? (double)fileBytes / payloadBytes : 1.0, payloadBytes);
+    if (elapsed > 0)
+        printf("Effective Throughput: %.0f bit/s\n", fileBytes * 8 / elapsed);
+    printf("------------------\n");
+}
+
+// Optional link features come from the environment, since main.c fixes the
+// command line (e.g. RCOM_ARQ=gbn RCOM_WINDOW=7 make run_tx).
+LinkLayerOptions loadLinkOptions()
+{
+    LinkLayerOptions options = lldefaultoptions();
+
+    const char *arq = getenv("RCOM_ARQ");
+    if (arq != NULL && strcmp(arq, "gbn") == 0)
+        options.arq = LlGoBackN;
+    else if (arq != NULL && strcmp(arq, "sr") == 0)
+        options.arq = LlSelectiveRepeat;
+
+    const char *windowSize = getenv("RCOM_WINDOW");
+    options.windowSize = windowSize != NULL ? atoi(windowSize) : MAX_WINDOW_SIZE;
+
+    const char *fcs = getenv("RCOM_FCS");
+    if (fcs != NULL && strcmp(fcs, "crc16") == 0)
+        options.fcs = LlFcsCrc16;
+    else if (fcs != NULL && strcmp(fcs, "crc32c") == 0)
+        options.fcs = LlFcsCrc32c;
+
+    const char *fec = getenv("RCOM_FEC");
+    if (fec != NULL)
+        options.fecParity = atoi(fec);
+
+    // Frames big enough for a whole data packet
+    options.maxPayloadSize = loadPacketSize() + DATA_HEADER_SIZE;
+
+    const char *vmin = getenv("RCOM_VMIN");
+    if (vmin != NULL)
+        options.readMinBytes = atoi(vmin);
+    const char *vtime = getenv("RCOM_VTIME");
+    if (vtime != NULL)
+        options.readTimeout = atoi(vtime);
+
+    // Milliseconds, fractions allowed
+    const char *timeout = getenv("RCOM_TIMEOUT_MS");
+    if (timeout != NULL)
+        options.timeoutMicros = (long)(atof(timeout) * 1000);
+    const char *fixedTimeout = getenv("RCOM_FIXED_TIMEOUT");
+    if (fixedTimeout != NULL)
+        options.fixedTimeout = atoi(fixedTimeout);
+
+    const char *adaptive = getenv("RCOM_ADAPTIVE_SIZE");
+    if (adaptive != NULL)
+        options.adaptivePayload = atoi(adaptive);
+
+    const char *ioThread = getenv("RCOM_IO_THREAD");
+    if (ioThread != NULL)
+        options.ioThread = atoi(ioThread);
+
+    const char *reconnect = getenv("RCOM_RECONNECT");
+    if (reconnect != NULL)
+        options.reconnectSeconds = atoi(reconnect);
+
+    options.metricsFile = getenv("RCOM_METRICS");
+    const char *metricsFormat = getenv("RCOM_METRICS_FORMAT");
+    if (metricsFormat != NULL && strcmp(metricsFormat, "prometheus") == 0)
+        options.metricsFormat = LlMetricsPrometheus;
+    const char *metricsInterval = getenv("RCOM_METRICS_INTERVAL");
+    if (metricsInterval != NULL)
+        options.metricsIntervalMicros = (long)(atof(metricsInterval) * 1000000);
+
+    return options;
+}
+
+// Sending side of a transfer: START, the data packets, then END
+typedef struct
+{
+    int channel;
+    FILE *file;
+    const char *fileName;
+    int fileSize;
+    int packetSize;
+    unsigned char codec;
+    // The file is mapped when it can be, and its packets sent straight from
+    // the mapping; otherwise they are read into dataBuffer
+    const unsigned char *mapping;
+    long offset;     // Of the next packet in the file
+    long readAhead;  // End of the part already asked from the disk
+    unsigned char *dataBuffer;
+    unsigned char *compressBuffer;
+    int sequenceNumber;
+    int done; // END sent
+    // Resumable transfer: the file's fingerprint (0 if not) and its journal
+    unsigned int fingerprint;
+    FILE *journal;
+    long journaled; // Offset last recorded in the journal
+} FileSender;
 
-        // Send START packet
-        unsigned char startPacket[1000];
-        int startPacketSize;
-        createControlPacket(startPacket, &startPacketSize, 0x01, fileSize, filename);
+// Receiving side of a transfer
+typedef struct
+{
+    FILE *file;
+    unsigned char codec;
+    unsigned char *receiveBuffer;
+    int decompressCapacity; // Largest data packet once decompressed
+    // Data is written behind, a buffer at a time, at the offset it belongs
+    unsigned char *writeBuffer;
+    int writeFill;
+    long offset; // In the file, of the start of writeBuffer
+    long fileSize; // Announced in START, the file is preallocated to it
+    int done; // END received
+    // Resumable transfer: the journal records each flush, with the file's
+    // fingerprint from START (or from the journal when resuming)
+    int resumable;
+    const char *fileName;
+    unsigned int fingerprint;
+    FILE *journal;
+} FileReceiver;
 
-        llwrite(startPacket, startPacketSize);
+// Sends a packet on the sender's channel. Bonding only stripes channel 0.
+int writePacket(FileSender *sender, const struct iovec *iov, int iovcnt)
+{
+    if (sender->channel > 0)
+        return llwritevchannel(sender->channel, iov, iovcnt);
+    return bondwritev(iov, iovcnt);
+}
 
-        // Send data packets
-        unsigned char dataBuffer[MAX_PACKET_SIZE];
-        int sequenceNumber = 0;
-        int bytesRead;
-        while ((bytesRead = fread(dataBuffer, 1, MAX_PACKET_SIZE, file)) > 0)
+// Opens the file and sends the START packet on the channel, then the data from
+// resumeOffset on. A fingerprint other than 0 keeps a journal of the transfer.
+// Returns -1 if the file can't be opened.
+int startSending(FileSender *sender, const char *filename, int channel, unsigned int fingerprint, int resumeOffset)
+{
+    memset(sender, 0, sizeof(*sender));
+    sender->channel = channel;
+    sender->fingerprint = fingerprint;
+    sender->file = fopen(filename, "rb");
+    if (!sender->file)
+    {
+        printf("ERROR: Failed to open file.\n");
+        return -1;
+    }
+    sender->fileName = filename;
+
+    // Get the size of the file
+    fseek(sender->file, 0, SEEK_END);
+    sender->fileSize = ftell(sender->file);
+    fseek(sender->file, 0, SEEK_SET);
+
+    // The file is read once, in order
+    posix_fadvise(fileno(sender->file), 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (sender->fileSize > 0)
+    {
+        void *mapping = mmap(NULL, sender->fileSize, PROT_READ, MAP_PRIVATE, fileno(sender->file), 0);
+        if (mapping != MAP_FAILED)
         {
-            unsigned char dataPacket[1000];
-            int dataPacketSize;
-            createDataPacket(dataPacket, &dataPacketSize, sequenceNumber, dataBuffer, bytesRead);
-            llwrite(dataPacket, dataPacketSize);
-            sequenceNumber = (sequenceNumber + 1) % 100;
+            sender->mapping = (const unsigned char *)mapping;
+            madvise(mapping, sender->fileSize, MADV_SEQUENTIAL);
         }
+    }
+
+    // Data packets as big as the agreed frame payload allows
+    sender->packetSize = loadPacketSize();
+    if (sender->packetSize > bondmaxpayload() - DATA_HEADER_SIZE)
+        sender->packetSize = bondmaxpayload() - DATA_HEADER_SIZE;
+    sender->codec = loadCodec();
 
+    // The part the receiver already holds is skipped
+    if (resumeOffset > 0 && resumeOffset <= sender->fileSize)
+    {
+        sender->offset = resumeOffset;
+        sender->readAhead = resumeOffset;
+        sender->journaled = resumeOffset;
+        fseek(sender->file, resumeOffset, SEEK_SET);
+    }
+
+    // Send START packet
+    unsigned char startPacket[1000];
+    int startPacketSize;
+    createControlPacket(startPacket, &startPacketSize, PACKET_START, sender->fileSize, filename, sender->codec, sender->packetSize,
+                        sender->fingerprint);
+
+    struct iovec packet = {startPacket, startPacketSize};
+    writePacket(sender, &packet, 1);
+
+    printf("Packet size: %d bytes\n", sender->packetSize);
+    if (sender->codec == CODEC_LZ)
+        printf("Compression: LZ\n");
+
+    sender->dataBuffer = sender->mapping == NULL ? (unsigned char *)malloc(sender->packetSize) : NULL;
+    sender->compressBuffer = sender->codec != CODEC_NONE ? (unsigned char *)malloc(sender->packetSize) : NULL;
+    return 1;
+}
+
+// Points data at the next chunkSize bytes of the file, in the mapping or read
+// into dataBuffer.
+// Returns the number of bytes, 0 at the end of the file.
+int nextFileChunk(FileSender *sender, int chunkSize, const unsigned char **data)
+{
+    if (sender->mapping == NULL)
+    {
+        *data = sender->dataBuffer;
+        int bytesRead = fread(sender->dataBuffer, 1, chunkSize, sender->file);
+        if (bytesRead <= 0)
+            return 0;
+        sender->offset += bytesRead;
+        return bytesRead;
+    }
+
+    if (chunkSize > sender->fileSize - sender->offset)
+        chunkSize = sender->fileSize - sender->offset;
+    // The pages of the next packets are read from the disk while the link
+    // sends this one
+    if (sender->offset + chunkSize > sender->readAhead - READ_AHEAD_SIZE / 2 && sender->readAhead < sender->fileSize)
+    {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        long start = sender->readAhead / pageSize * pageSize;
+        sender->readAhead = sender->offset + READ_AHEAD_SIZE;
+        if (sender->readAhead > sender->fileSize)
+            sender->readAhead = sender->fileSize;
+        madvise((void *)(sender->mapping + start), sender->readAhead - start, MADV_WILLNEED);
+    }
+    *data = sender->mapping + sender->offset;
+    sender->offset += chunkSize;
+    return chunkSize;
+}
+
+// Sends the next data packet, or the END packet once the file is sent
+void sendNextPacket(FileSender *sender)
+{
+    // The link may ask for smaller packets on a noisy line
+    int chunkSize = bondpreferredpayload() - DATA_HEADER_SIZE;
+    if (chunkSize > sender->packetSize)
+        chunkSize = sender->packetSize;
+    const unsigned char *fileData;
+    int bytesRead = nextFileChunk(sender, chunkSize, &fileData);
+    if (bytesRead <= 0)
+    {
         // Send END packet
         unsigned char endPacket[1000];
         int endPacketSize;
-        createControlPacket(endPacket, &endPacketSize, 0x03, fileSize, filename);
-        llwrite(endPacket, endPacketSize);
+        createControlPacket(endPacket, &endPacketSize, PACKET_END, sender->fileSize, sender->fileName, CODEC_NONE, 0, 0);
+        struct iovec packet = {endPacket, endPacketSize};
+        writePacket(sender, &packet, 1);
+        sender->done = TRUE;
+        return;
+    }
 
-        fclose(file);
+    // Packets that don't shrink are sent as they are
+    unsigned char packetType = PACKET_DATA;
+    const unsigned char *payload = fileData;
+    int payloadSize = bytesRead;
+    if (sender->codec == CODEC_LZ)
+    {
+        int compressedSize = lzCompress(fileData, bytesRead, sender->compressBuffer, bytesRead - 1);
+        if (compressedSize > 0)
+        {
+            packetType = PACKET_COMPRESSED_DATA;
+            payload = sender->compressBuffer;
+            payloadSize = compressedSize;
+        }
     }
 
-    else if (connectionParameters.role == LlRx)
+    unsigned char dataHeader[DATA_HEADER_SIZE];
+    createDataPacketHeader(dataHeader, packetType, sender->sequenceNumber, payloadSize);
+    struct iovec dataPacket[2] = {{dataHeader, sizeof(dataHeader)}, {(void *)payload, payloadSize}};
+    writePacket(sender, dataPacket, 2);
+    fileBytes += bytesRead;
+    payloadBytes += payloadSize;
+    sender->sequenceNumber = (sender->sequenceNumber + 1) % 100;
+
+    if (sender->fingerprint != 0 && sender->offset - sender->journaled >= JOURNAL_INTERVAL)
     {
-        file = fopen(filename, "wb");
-        if (!file)
+        saveJournal(&sender->journal, sender->fileName, sender->fingerprint, sender->offset);
+        sender->journaled = sender->offset;
+    }
+}
+
+void stopSending(FileSender *sender)
+{
+    if (sender->file == NULL)
+        return;
+    if (sender->mapping != NULL)
+        munmap((void *)sender->mapping, sender->fileSize);
+    // The journal stays until the link closed cleanly
+    if (sender->journal != NULL)
+        fclose(sender->journal);
+    sender->journal = NULL;
+    free(sender->dataBuffer);
+    free(sender->compressBuffer);
+    fclose(sender->file);
+}
+
+// Creates the file the data is written to, or opens the one being resumed
+// to write from resumeOffset on. A resumable transfer keeps a journal.
+// Returns -1 if the file can't be created.
+int startReceiving(FileReceiver *receiver, const char *filename, int resumable, int resumeOffset)
+{
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->file = fopen(filename, resumeOffset > 0 ? "r+b" : "wb");
+    if (!receiver->file)
+    {
+        printf("ERROR: Failed to open file.\n");
+        return -1;
+    }
+    receiver->resumable = resumable;
+    receiver->fileName = filename;
+    receiver->offset = resumeOffset;
+    if (resumeOffset > 0)
+    {
+        // Only the fingerprint is needed, the link agreed on the offset
+        int journalOffset;
+        loadJournal(filename, &receiver->fingerprint, &journalOffset);
+    }
+
+    // Room for the largest packet the link can deliver
+    receiver->receiveBuffer = (unsigned char *)malloc(bondmaxpayload());
+    void *writeBuffer = NULL;
+    if (receiver->receiveBuffer == NULL || posix_memalign(&writeBuffer, sysconf(_SC_PAGESIZE), WRITE_BEHIND_SIZE) != 0)
+    {
+        printf("ERROR: Failed to allocate the receive buffers.\n");
+        free(receiver->receiveBuffer);
+        fclose(receiver->file);
+        // Nothing left for stopReceiving
+        memset(receiver, 0, sizeof(*receiver));
+        return -1;
+    }
+    receiver->writeBuffer = (unsigned char *)writeBuffer;
+    return 1;
+}
+
+// Writes the gathered data to the file at its offset.
+// Returns -1 on error.
+int flushReceived(FileReceiver *receiver)
+{
+    int written = 0;
+    while (written < receiver->writeFill)
+    {
+        ssize_t bytes = pwrite(fileno(receiver->file), receiver->writeBuffer + written, receiver->writeFill - written, receiver->offset + written);
+        if (bytes < 0)
         {
-            printf("ERROR: Failed to open file.\n");
-            llclose(1);
-            return;
+            perror("pwrite");
+            return -1;
         }
+        written += bytes;
+    }
+    receiver->offset += receiver->writeFill;
+    receiver->writeFill = 0;
 
-        unsigned char receiveBuffer[MAX_PACKET_SIZE] = {0};
-        //int bytesRead;
-        int receiving = 1;
+    // The journal never gets ahead of the data on the disk
+    if (receiver->resumable && receiver->fingerprint != 0 && written > 0)
+    {
+        if (fdatasync(fileno(receiver->file)) < 0)
+            perror("fdatasync");
+        saveJournal(&receiver->journal, receiver->fileName, receiver->fingerprint, receiver->offset);
+    }
+    return 1;
+}
 
-        printf("--------------LLREAD--------------\n");
+// Room in the write buffer for size more bytes, flushing it if needed.
+// Returns where they go, or NULL on error.
+unsigned char *receivedSpace(FileReceiver *receiver, int size)
+{
+    if (receiver->writeFill + size > WRITE_BEHIND_SIZE && flushReceived(receiver) < 0)
+        return NULL;
+    return receiver->writeBuffer + receiver->writeFill;
+}
 
-        while (receiving)
+// Handles a packet received for the transfer
+void handlePacket(FileReceiver *receiver, const unsigned char *receiveBuffer, int packetSize)
+{
+    if (packetSize < 1)
+        return;
+    if (receiveBuffer[0] == PACKET_START)
+    {
+        printf("Received START packet\n");
+        int fileSize = 0;
+        int maxDataSize = MAX_DATA_SIZE;
+        unsigned int fingerprint = 0;
+        parseControlPacket(receiveBuffer, packetSize, &fileSize, &receiver->codec, &maxDataSize, &fingerprint);
+        if (receiver->fingerprint == 0)
+            receiver->fingerprint = fingerprint;
+        if (receiver->codec == CODEC_LZ)
         {
-            llread(receiveBuffer);
-            if (receiveBuffer[0] == 1)
-            {
-                printf("Received START packet\n");
-                // Opcionalmente processar o packet
-            }
-            else if (receiveBuffer[0] == 2)
+            printf("Compression: LZ\n");
+            receiver->decompressCapacity = maxDataSize;
+        }
+        // The whole file is reserved at once, so it is not extended a write
+        // at a time
+        receiver->fileSize = fileSize;
+        if (fileSize > 0 && posix_fallocate(fileno(receiver->file), 0, fileSize) != 0)
+            printf("Could not preallocate the file, writing it as it arrives.\n");
+    }
+    else if (receiveBuffer[0] == PACKET_DATA || receiveBuffer[0] == PACKET_COMPRESSED_DATA)
+    {
+        // The header and the data it announces must both have arrived
+        if (packetSize < DATA_HEADER_SIZE)
+        {
+            printf("ERROR: Data packet shorter than its header.\n");
+            return;
+        }
+        int dataSize = (receiveBuffer[2] << 8) | receiveBuffer[3];
+        if (dataSize > packetSize - DATA_HEADER_SIZE)
+        {
+            printf("ERROR: Corrupt data packet.\n");
+            return;
+        }
+        payloadBytes += dataSize;
+
+        const unsigned char *data = &receiveBuffer[4];
+        if (receiveBuffer[0] == PACKET_COMPRESSED_DATA && receiver->decompressCapacity == 0)
+        {
+            printf("ERROR: Compressed packet without a codec in START.\n");
+            return;
+        }
+        // Compressed packets are decompressed straight into the write buffer
+        int spaceNeeded = receiveBuffer[0] == PACKET_COMPRESSED_DATA ? receiver->decompressCapacity : dataSize;
+        unsigned char *space = receivedSpace(receiver, spaceNeeded);
+        if (space == NULL)
+            return;
+        if (receiveBuffer[0] == PACKET_COMPRESSED_DATA)
+        {
+            dataSize = lzDecompress(data, dataSize, space, receiver->decompressCapacity);
+            if (dataSize < 0)
             {
-                int dataSize = (receiveBuffer[2] << 8) | receiveBuffer[3];
-                fwrite(&receiveBuffer[4], 1, dataSize, file);
+                printf("ERROR: Corrupt compressed packet.\n");
+                return;
             }
-            else if (receiveBuffer[0] == 3)
+        }
+        else
+            memcpy(space, data, dataSize);
+        receiver->writeFill += dataSize;
+        fileBytes += dataSize;
+
+        // A resumable transfer is written and journaled as often as the
+        // transmitter journals, so a cut loses little of what was received
+        if (receiver->resumable && receiver->fingerprint != 0 && receiver->writeFill >= JOURNAL_INTERVAL)
+            flushReceived(receiver);
+    }
+    else if (receiveBuffer[0] == PACKET_END)
+    {
+        printf("Received END packet\n");
+        if (flushReceived(receiver) > 0 && receiver->resumable)
+            removeJournal(&receiver->journal, receiver->fileName);
+        receiver->done = TRUE;
+    }
+}
+
+// Reads and handles the next packet
+void receiveNextPacket(FileReceiver *receiver, int nPorts)
+{
+    int packetSize = bondread(receiver->receiveBuffer);
+    // Bonded links that are gone won't deliver the packet later
+    if (packetSize < 0 && nPorts > 1)
+    {
+        receiver->done = TRUE;
+        return;
+    }
+    handlePacket(receiver, receiver->receiveBuffer, packetSize);
+}
+
+// Reads the next packet of whichever channel has one and hands it to the
+// transfer on that channel
+void receiveAnyPacket(FileReceiver receivers[], unsigned char *packet)
+{
+    int channel;
+    int packetSize = llreadany(&channel, packet);
+    if (channel < FILE_CHANNELS && !receivers[channel].done)
+        handlePacket(&receivers[channel], packet, packetSize);
+}
+
+void stopReceiving(FileReceiver *receiver)
+{
+    if (receiver->file == NULL)
+        return;
+    // A transfer cut short leaves no preallocated tail behind
+    flushReceived(receiver);
+    if (receiver->offset < receiver->fileSize && ftruncate(fileno(receiver->file), receiver->offset) < 0)
+        perror("ftruncate");
+    if (receiver->journal != NULL)
+        fclose(receiver->journal);
+    free(receiver->receiveBuffer);
+    free(receiver->writeBuffer);
+    fclose(receiver->file);
+}
+
+void applicationLayer(const char *serialPort, const char *role, int baudRate,
+                      int nTries, int timeout, const char *filename)
+{
+    time(&start);  // Get the current time
+    clock_gettime(CLOCK_MONOTONIC, &transferStart);
+    
+    LinkLayer connectionParameters;
+
+    strcpy(connectionParameters.serialPort, serialPort);
+    connectionParameters.baudRate = baudRate;
+    connectionParameters.nRetransmissions = nTries;
+    connectionParameters.timeout = timeout;
+    connectionParameters.role = strcmp(role, "tx") ? LlRx : LlTx;
+
+    const char *serialPorts[BOND_MAX_LINKS];
+    char bondPorts[1000];
+    int nPorts = loadSerialPorts(serialPort, serialPorts, bondPorts);
+
+    // The file sent back by the receiver, or where the transmitter saves it
+    const char *duplexFile = getenv("RCOM_DUPLEX");
+    if (duplexFile != NULL && nPorts > 1)
+    {
+        // Every bonded link carries a single direction
+        printf("RCOM_DUPLEX is ignored with RCOM_BOND_PORTS.\n");
+        duplexFile = NULL;
+    }
+    // A second file, sent by the transmitter on a channel of its own
+    const char *channelFile = getenv("RCOM_CHANNEL_FILE");
+    if (channelFile != NULL && nPorts > 1)
+    {
+        printf("RCOM_CHANNEL_FILE is ignored with RCOM_BOND_PORTS.\n");
+        channelFile = NULL;
+    }
+    LinkLayerOptions options = loadLinkOptions();
+    if (options.metricsFile != NULL && nPorts > 1)
+    {
+        // The bonded links would all write the same file
+        printf("RCOM_METRICS is ignored with RCOM_BOND_PORTS.\n");
+        options.metricsFile = NULL;
+    }
+    options.duplex = duplexFile != NULL;
+    options.channels = channelFile != NULL ? FILE_CHANNELS : 1;
+
+    // Only the file of the command line is resumed, from the transmitter to
+    // the receiver
+    int resume = loadResume();
+    if (resume && nPorts > 1)
+    {
+        printf("RCOM_RESUME is ignored with RCOM_BOND_PORTS.\n");
+        resume = FALSE;
+    }
+    unsigned int fingerprint = 0;
+    if (resume)
+    {
+        // Each side offers what its journal holds; the transmitter always
+        // offers the fingerprint, so a new transfer gets a journal too
+        unsigned int journalFingerprint = 0;
+        int journalOffset = 0;
+        loadJournal(filename, &journalFingerprint, &journalOffset);
+        fingerprint = connectionParameters.role == LlTx ? fileFingerprint(filename) : journalFingerprint;
+        options.resumeFingerprint = fingerprint;
+        options.resumeOffset = journalFingerprint == fingerprint ? journalOffset : 0;
+    }
+    llsetoptions(options);
+
+    printf("--------------LLOPEN--------------\n");
+    // Call llopen to initialize the link layer connection, once per port
+    if (bondopen(connectionParameters, serialPorts, nPorts) < 0)
+    {
+        printf("ERROR: Failed to open link layer connection.\n");
+        return;
+    }
+    if (duplexFile != NULL && !llduplex())
+    {
+        printf("The other side did not agree to a duplex link.\n");
+        duplexFile = NULL;
+    }
+    if (channelFile != NULL && llchannels() < FILE_CHANNELS)
+    {
+        printf("The other side did not agree to a second channel.\n");
+        channelFile = NULL;
+    }
+
+    // The transmitter sends its file and the receiver saves it; on a duplex
+    // link the receiver sends one back at the same time. The second file goes
+    // the transmitter's way on channel 1.
+    int isTx = connectionParameters.role == LlTx;
+    int resumeOffset = resume ? llresumeoffset() : 0;
+    const char *sendFiles[FILE_CHANNELS] = {isTx ? filename : duplexFile, isTx ? channelFile : NULL};
+    const char *receiveFiles[FILE_CHANNELS] = {isTx ? duplexFile : filename, isTx ? NULL : channelFile};
+    FileSender senders[FILE_CHANNELS] = {{.done = TRUE}, {.done = TRUE}};
+    FileReceiver receivers[FILE_CHANNELS] = {{.done = TRUE}, {.done = TRUE}};
+    unsigned char *packet = NULL; // Packets of any channel, see receiveAnyPacket
+
+    int failed = FALSE;
+    for (int i = 0; i < FILE_CHANNELS && !failed; i++)
+    {
+        if (sendFiles[i] == NULL)
+            continue;
+        if (i == 0 || sendFiles[0] == NULL)
+            printf("--------------LLWRITE--------------\n");
+        int resumed = isTx && i == 0;
+        failed = startSending(&senders[i], sendFiles[i], i, resumed ? fingerprint : 0, resumed ? resumeOffset : 0) < 0;
+    }
+    for (int i = 0; i < FILE_CHANNELS && !failed; i++)
+    {
+        if (receiveFiles[i] != NULL)
+        {
+            int resumed = !isTx && i == 0;
+            failed = startReceiving(&receivers[i], receiveFiles[i], resumed && resume, resumed ? resumeOffset : 0) < 0;
+        }
+    }
+    if (!failed && (receiveFiles[0] != NULL || receiveFiles[1] != NULL))
+    {
+        packet = (unsigned char *)malloc(bondmaxpayload());
+        if (packet == NULL)
+        {
+            printf("ERROR: Failed to allocate the packet buffer.\n");
+            failed = TRUE;
+        }
+        else
+            printf("--------------LLREAD--------------\n");
+    }
+    if (failed)
+    {
+        for (int i = 0; i < FILE_CHANNELS; i++)
+        {
+            stopSending(&senders[i]);
+            stopReceiving(&receivers[i]);
+        }
+        bondclose(1);
+        return;
+    }
+
+    // Each round sends one packet, the senders taking turns, and receives one,
+    // until all ENDs went through. Never sending more than it reads keeps a
+    // side from filling the other's receive buffers while both are writing.
+    int turn = 0;
+    while (!senders[0].done || !senders[1].done || !receivers[0].done || !receivers[1].done)
+    {
+        for (int i = 0; i < FILE_CHANNELS; i++)
+        {
+            int next = (turn + i) % FILE_CHANNELS;
+            if (!senders[next].done)
             {
-                printf("Received END packet\n");
-                receiving = 0;
+                sendNextPacket(&senders[next]);
+                turn = next + 1;
+                break;
             }
         }
+        if (receivers[0].done && receivers[1].done)
+            continue;
+        if (llchannels() > 1)
+            receiveAnyPacket(receivers, packet);
+        else
+            receiveNextPacket(&receivers[0], nPorts);
+    }
 
-        fclose(file);
+    for (int i = 0; i < FILE_CHANNELS; i++)
+    {
+        stopSending(&senders[i]);
+        stopReceiving(&receivers[i]);
     }
+    free(packet);
 
     printf("--------------LLCLOSE--------------\n");
-    if (llclose(1) < 0)
+    if (bondclose(1) < 0)
     {
         printf("ERROR: Failed to close link layer connection.\n");
         return;
     }
+    if (isTx && resume)
+        removeJournal(&senders[0].journal, filename);
+    printTransferStatistics(senders[0].codec != CODEC_NONE ? senders[0].codec : receivers[0].codec);
 }
\ No newline at end of file
@@ -0,0 +1,496 @@
+// Multi-link bonding implementation
+//
+// Every bonded link runs in its own process, forked in bondopen, which talks
+// to the application through a pair of Unix sockets. The link layer ends the process
+// when it gives up on a link, so this keeps a failed link from taking the
+// others down with it. The transmitter hands each packet to a link that has
+// finished its previous one and prefixes it with a bond sequence number. Each
+// link delivers its packets in order, so the receiver only looks at the oldest
+// undelivered packet of every link and returns the one with the next sequence
+// number. A link whose oldest packet has to wait is not read further, which
+// stops its sender through the link's own flow control.
+
+#include "bonding.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Bond sequence number, big-endian, in front of every packet
+#define BOND_HEADER_SIZE 4
+// Sequence number of the packet a transmitting link sends last, on its own
+#define BOND_LAST_SEQUENCE 0xFFFFFFFF
+
+typedef struct
+{
+    pid_t pid;
+    char serialPort[50];
+    int toLink;   // Packets for the link process to send (transmitter)
+    int fromLink; // Write results (transmitter) or received packets (receiver)
+    int maxPayload;
+    int preferredPayload;
+    int busy;   // Transmitter: writing a packet
+    int closed; // Receiver: no more packets from this link
+    unsigned char *head; // Receiver: oldest packet not yet delivered
+    int headSize;        // -1 if there is none
+    unsigned int headSequence;
+    long packets;
+} BondLink;
+
+static BondLink links[BOND_MAX_LINKS];
+static int nLinks = 0;
+static int bonded = FALSE; // More than one link, each in a link process
+static LinkLayerRole bondRole;
+static unsigned int nextSequence = 0; // Of the next packet written or delivered
+static int nextLink = -1;             // Idle link chosen for the next packet
+
+////////////////////////////////////////////////
+// LINK SOCKETS
+////////////////////////////////////////////////
+// The sockets to the link processes are socket pairs rather than pipes, so a
+// write to a link process that exited fails with EPIPE (MSG_NOSIGNAL) instead
+// of raising SIGPIPE in the caller's process.
+
+// Returns size, 0 at end of file or -1 on error
+static int readFull(int fd, void *buf, int size)
+{
+    int done = 0;
+    while (done < size)
+    {
+        int n = read(fd, (unsigned char *)buf + done, size - done);
+        if (n <= 0)
+            return n;
+        done += n;
+    }
+    return done;
+}
+
+// Returns size or -1 on error
+static int writeFull(int fd, const void *buf, int size)
+{
+    int done = 0;
+    while (done < size)
+    {
+        int n = send(fd, (const unsigned char *)buf + done, size - done, MSG_NOSIGNAL);
+        if (n < 0)
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+static void encodeSequence(unsigned char *header, unsigned int sequence)
+{
+    header[0] = (sequence >> 24) & 0xFF;
+    header[1] = (sequence >> 16) & 0xFF;
+    header[2] = (sequence >> 8) & 0xFF;
+    header[3] = sequence & 0xFF;
+}
+
+static unsigned int decodeSequence(const unsigned char *header)
+{
+    return (unsigned int)header[0] << 24 | (unsigned int)header[1] << 16 | (unsigned int)header[2] << 8 | header[3];
+}
+
+////////////////////////////////////////////////
+// LINK PROCESSES
+////////////////////////////////////////////////
+// Sends the packets read from toLink, answering each with llpreferredpayload()
+// or -1, until an empty one asks it to close
+static void runTxLink(int toLink, int fromLink)
+{
+    unsigned char *packet = (unsigned char *)malloc(llmaxpayload());
+    int size;
+    while (readFull(toLink, &size, sizeof(size)) > 0 && size > 0)
+    {
+        if (readFull(toLink, packet, size) <= 0)
+            break;
+        int result = llwrite(packet, size) < 0 ? -1 : llpreferredpayload();
+        writeFull(fromLink, &result, sizeof(result));
+    }
+    free(packet);
+
+    // Tell the receiving link process there is nothing more on this link
+    unsigned char last[BOND_HEADER_SIZE];
+    encodeSequence(last, BOND_LAST_SEQUENCE);
+    llwrite(last, sizeof(last));
+    exit(llclose(TRUE) < 0 ? -1 : 0);
+}
+
+// Passes every packet received to fromLink, ending with an empty one
+static void runRxLink(int fromLink)
+{
+    unsigned char *packet = (unsigned char *)malloc(llmaxpayload());
+    while (TRUE)
+    {
+        int size = llread(packet);
+        if (size < 1)
+            continue;
+        if (size == BOND_HEADER_SIZE && decodeSequence(packet) == BOND_LAST_SEQUENCE)
+            break;
+        writeFull(fromLink, &size, sizeof(size));
+        writeFull(fromLink, packet, size);
+    }
+    free(packet);
+
+    int last = 0;
+    writeFull(fromLink, &last, sizeof(last));
+    exit(llclose(TRUE) < 0 ? -1 : 0);
+}
+
+static void stopLinks()
+{
+    for (int i = 0; i < nLinks; i++)
+    {
+        kill(links[i].pid, SIGTERM);
+        waitpid(links[i].pid, NULL, 0);
+        close(links[i].toLink);
+        close(links[i].fromLink);
+        free(links[i].head);
+    }
+    nLinks = 0;
+    bonded = FALSE;
+}
+
+////////////////////////////////////////////////
+// BONDOPEN
+////////////////////////////////////////////////
+int bondopen(LinkLayer connectionParameters, const char *serialPorts[], int nPorts)
+{
+    bondRole = connectionParameters.role;
+    nextSequence = 0;
+    nextLink = -1;
+
+    if (nPorts == 1)
+    {
+        strcpy(connectionParameters.serialPort, serialPorts[0]);
+        return llopen(connectionParameters) < 0 ? -1 : 1;
+    }
+    if (nPorts < 1 || nPorts > BOND_MAX_LINKS)
+    {
+        printf("ERROR: Between 1 and %d serial ports can be bonded.\n", BOND_MAX_LINKS);
+        return -1;
+    }
+
+    bonded = TRUE;
+
+    for (int i = 0; i < nPorts; i++)
+    {
+        int toLink[2], fromLink[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, toLink) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, fromLink) < 0)
+        {
+            perror("socketpair");
+            stopLinks();
+            return -1;
+        }
+
+        // Nothing buffered may be printed twice
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            stopLinks();
+            return -1;
+        }
+        if (pid == 0)
+        {
+            for (int j = 0; j < i; j++)
+            {
+                close(links[j].toLink);
+                close(links[j].fromLink);
+            }
+            close(toLink[1]);
+            close(fromLink[0]);
+
+            strncpy(connectionParameters.serialPort, serialPorts[i], sizeof(connectionParameters.serialPort) - 1);
+            connectionParameters.serialPort[sizeof(connectionParameters.serialPort) - 1] = '\0';
+            int payload[2] = {-1, -1};
+            if (llopen(connectionParameters) >= 0)
+            {
+                payload[0] = llmaxpayload();
+                payload[1] = llpreferredpayload();
+            }
+            writeFull(fromLink[1], payload, sizeof(payload));
+            if (payload[0] < 0)
+                exit(-1);
+
+            if (bondRole == LlTx)
+                runTxLink(toLink[0], fromLink[1]);
+            else
+                runRxLink(fromLink[1]);
+        }
+
+        close(toLink[0]);
+        close(fromLink[1]);
+        BondLink *link = &links[nLinks++];
+        memset(link, 0, sizeof(*link));
+        link->pid = pid;
+        strncpy(link->serialPort, serialPorts[i], sizeof(link->serialPort) - 1);
+        link->toLink = toLink[1];
+        link->fromLink = fromLink[0];
+        link->headSize = -1;
+    }
+
+    for (int i = 0; i < nLinks; i++)
+    {
+        int payload[2];
+        if (readFull(links[i].fromLink, payload, sizeof(payload)) <= 0 || payload[0] < 0)
+        {
+            printf("ERROR: Failed to open link %d (%s).\n", i, links[i].serialPort);
+            stopLinks();
+            return -1;
+        }
+        links[i].maxPayload = payload[0];
+        links[i].preferredPayload = payload[1];
+        if (bondRole == LlRx)
+            links[i].head = (unsigned char *)malloc(payload[0]);
+    }
+
+    printf("Bonded %d links\n", nLinks);
+    return nLinks;
+}
+
+int bondmaxpayload()
+{
+    if (!bonded)
+        return llmaxpayload();
+
+    int maxPayload = links[0].maxPayload;
+    for (int i = 1; i < nLinks; i++)
+        if (links[i].maxPayload < maxPayload)
+            maxPayload = links[i].maxPayload;
+    return maxPayload - BOND_HEADER_SIZE;
+}
+
+////////////////////////////////////////////////
+// BONDWRITE
+////////////////////////////////////////////////
+// Waits until a link has finished its packet.
+// Returns the index of an idle link, or -1 if a link failed.
+static int idleLink()
+{
+    if (nextLink >= 0)
+        return nextLink;
+
+    while (TRUE)
+    {
+        for (int i = 0; i < nLinks; i++)
+        {
+            if (!links[i].busy)
+                return nextLink = i;
+        }
+
+        struct pollfd fds[BOND_MAX_LINKS];
+        for (int i = 0; i < nLinks; i++)
+        {
+            fds[i].fd = links[i].fromLink;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, nLinks, -1) < 0)
+        {
+            perror("poll");
+            return -1;
+        }
+
+        for (int i = 0; i < nLinks; i++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+            int preferredPayload;
+            if (readFull(links[i].fromLink, &preferredPayload, sizeof(preferredPayload)) <= 0 || preferredPayload < 0)
+            {
+                printf("ERROR: Link %d (%s) failed.\n", i, links[i].serialPort);
+                return -1;
+            }
+            links[i].preferredPayload = preferredPayload;
+            links[i].busy = FALSE;
+        }
+    }
+}
+
+int bondpreferredpayload()
+{
+    if (!bonded)
+        return llpreferredpayload();
+
+    int link = idleLink();
+    if (link < 0 || links[link].preferredPayload - BOND_HEADER_SIZE > bondmaxpayload())
+        return bondmaxpayload();
+    return links[link].preferredPayload - BOND_HEADER_SIZE;
+}
+
+int bondwritev(const struct iovec *iov, int iovcnt)
+{
+    if (!bonded)
+        return llwritev(iov, iovcnt);
+
+    int link = idleLink();
+    if (link < 0)
+        return -1;
+
+    int size = BOND_HEADER_SIZE;
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    if (size > links[link].maxPayload)
+    {
+        printf("ERROR: Packet of %d bytes is larger than the bonded links allow.\n", size - BOND_HEADER_SIZE);
+        return -1;
+    }
+
+    unsigned char header[BOND_HEADER_SIZE];
+    encodeSequence(header, nextSequence);
+
+    int fd = links[link].toLink;
+    if (writeFull(fd, &size, sizeof(size)) < 0 || writeFull(fd, header, sizeof(header)) < 0)
+    {
+        printf("ERROR: Link %d (%s) failed.\n", link, links[link].serialPort);
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (writeFull(fd, iov[i].iov_base, iov[i].iov_len) < 0)
+        {
+            printf("ERROR: Link %d (%s) failed.\n", link, links[link].serialPort);
+            return -1;
+        }
+    }
+
+    links[link].busy = TRUE;
+    links[link].packets++;
+    nextLink = -1;
+    nextSequence++;
+    return size - BOND_HEADER_SIZE;
+}
+
+int bondwrite(const unsigned char *buf, int bufSize)
+{
+    struct iovec iov = {(void *)buf, bufSize};
+    return bondwritev(&iov, 1);
+}
+
+////////////////////////////////////////////////
+// BONDREAD
+////////////////////////////////////////////////
+// Reads the next packet of a link into its head
+static void readHead(BondLink *link)
+{
+    int size;
+    if (readFull(link->fromLink, &size, sizeof(size)) <= 0 || size == 0)
+    {
+        link->closed = TRUE;
+        return;
+    }
+    if (size < BOND_HEADER_SIZE || size > link->maxPayload || readFull(link->fromLink, link->head, size) <= 0)
+    {
+        printf("ERROR: Bad packet from link %s.\n", link->serialPort);
+        link->closed = TRUE;
+        return;
+    }
+
+    link->headSize = size;
+    link->headSequence = decodeSequence(link->head);
+}
+
+int bondread(unsigned char *packet)
+{
+    if (!bonded)
+        return llread(packet);
+
+    while (TRUE)
+    {
+        struct pollfd fds[BOND_MAX_LINKS];
+        BondLink *waiting[BOND_MAX_LINKS];
+        int nWaiting = 0;
+
+        for (int i = 0; i < nLinks; i++)
+        {
+            BondLink *link = &links[i];
+            if (link->headSize >= 0 && link->headSequence == nextSequence)
+            {
+                int size = link->headSize - BOND_HEADER_SIZE;
+                memcpy(packet, &link->head[BOND_HEADER_SIZE], size);
+                link->headSize = -1;
+                link->packets++;
+                nextSequence++;
+                return size;
+            }
+            if (link->headSize < 0 && !link->closed)
+            {
+                fds[nWaiting].fd = link->fromLink;
+                fds[nWaiting].events = POLLIN;
+                fds[nWaiting].revents = 0;
+                waiting[nWaiting++] = link;
+            }
+        }
+
+        // Every link is closed or holds a later packet
+        if (nWaiting == 0)
+        {
+            printf("ERROR: Packet %u missing from the bonded links.\n", nextSequence);
+            return -1;
+        }
+
+        if (poll(fds, nWaiting, -1) < 0)
+        {
+            perror("poll");
+            return -1;
+        }
+        for (int i = 0; i < nWaiting; i++)
+        {
+            if (fds[i].revents != 0)
+                readHead(waiting[i]);
+        }
+    }
+}
+
+////////////////////////////////////////////////
+// BONDCLOSE
+////////////////////////////////////////////////
+int bondclose(int showStatistics)
+{
+    if (!bonded)
+        return llclose(showStatistics);
+
+    int result = 1;
+    for (int i = 0; i < nLinks; i++)
+    {
+        if (bondRole == LlTx)
+        {
+            int last = 0;
+            writeFull(links[i].toLink, &last, sizeof(last));
+        }
+        close(links[i].toLink);
+    }
+
+    // Each link process closes its link, printing the statistics
+    for (int i = 0; i < nLinks; i++)
+    {
+        int status;
+        if (waitpid(links[i].pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("ERROR: Link %d (%s) failed to close.\n", i, links[i].serialPort);
+            result = -1;
+        }
+        close(links[i].fromLink);
+        free(links[i].head);
+    }
+
+    if (showStatistics)
+    {
+        printf("---- Bonding ----\n");
+        for (int i = 0; i < nLinks; i++)
+            printf("Link %d (%s): %ld packets\n", i, links[i].serialPort, links[i].packets);
+        printf("-----------------\n");
+    }
+
+    nLinks = 0;
+    bonded = FALSE;
+    return result;
+}
@@ -0,0 +1,147 @@
+// Byte stuffing implementation
+//
+// Both directions look for the next FLAG or ESC with a vector scan (AVX2 or
+// SSE2, picked at run time, with a scalar fallback) and copy the runs in
+// between with memcpy, so the per-byte work is only done on special bytes.
+
+#include "byte_stuffing.h"
+#include "frame_check.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define ESC_XOR 0x20 // ESC 0x5E -> FLAG, ESC 0x5D -> ESC
+
+static int findSpecialScalar(const unsigned char *data, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (data[i] == FLAG || data[i] == ESC)
+            return i;
+    }
+    return size;
+}
+
+#if defined(__x86_64__)
+static int findSpecialSse2(const unsigned char *data, int size)
+{
+    const __m128i flag = _mm_set1_epi8(FLAG);
+    const __m128i esc = _mm_set1_epi8(ESC);
+    int i = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + findSpecialScalar(&data[i], size - i);
+}
+
+__attribute__((target("avx2"))) static int findSpecialAvx2(const unsigned char *data, int size)
+{
+    const __m256i flag = _mm256_set1_epi8(FLAG);
+    const __m256i esc = _mm256_set1_epi8(ESC);
+    int i = 0;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, flag), _mm256_cmpeq_epi8(v, esc)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + findSpecialSse2(&data[i], size - i);
+}
+#endif
+
+static int (*findSpecial)(const unsigned char *, int) = findSpecialScalar;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+// Picks the widest kernel the CPU supports, once for all links
+static void pickKernel()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        findSpecial = findSpecialAvx2;
+    else
+        findSpecial = findSpecialSse2;
+#endif
+}
+
+int findSpecialByte(const unsigned char *data, int size)
+{
+    pthread_once(&kernelOnce, pickKernel);
+    return findSpecial(data, size);
+}
+
+int stuffBytes(const unsigned char *data, int size, unsigned char *out, LinkLayerFcs type, unsigned int *fcs)
+{
+    int i = 0;
+    int j = 0;
+    pthread_once(&kernelOnce, pickKernel);
+
+    while (i < size)
+    {
+        int run = findSpecial(&data[i], size - i);
+        memcpy(&out[j], &data[i], run);
+        j += run;
+
+        // The special byte (if any) is checked together with its run
+        int checked = (i + run < size) ? run + 1 : run;
+        if (fcs != NULL)
+            *fcs = fcsUpdate(type, *fcs, &data[i], checked);
+
+        i += run;
+        if (i < size)
+        {
+            out[j++] = ESC;
+            out[j++] = data[i++] ^ ESC_XOR;
+        }
+    }
+    return j;
+}
+
+int destuffBytes(const unsigned char *data, int size, unsigned char *out, int *outSize,
+                 int *escPending, LinkLayerFcs type, unsigned int *fcs)
+{
+    int i = 0;
+    int j = 0;
+    pthread_once(&kernelOnce, pickKernel);
+
+    while (i < size)
+    {
+        if (*escPending)
+        {
+            if (data[i] == FLAG)
+                break;
+            out[j] = data[i++] ^ ESC_XOR;
+            if (fcs != NULL)
+                *fcs = fcsUpdateByte(type, *fcs, out[j]);
+            j++;
+            *escPending = FALSE;
+            continue;
+        }
+
+        int run = findSpecial(&data[i], size - i);
+        memcpy(&out[j], &data[i], run);
+        if (fcs != NULL)
+            *fcs = fcsUpdate(type, *fcs, &out[j], run);
+        i += run;
+        j += run;
+
+        if (i == size || data[i] == FLAG)
+            break;
+        *escPending = TRUE;
+        i++;
+    }
+
+    *outSize = j;
+    return i;
+}
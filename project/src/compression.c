@@ -0,0 +1,173 @@
+// Packet compression
+//
+// A greedy LZ77 compressor writing the LZ4 block format: sequences of a
+// token (literal length << 4 | match length - 4), the literals and a 16-bit
+// little-endian match offset, with lengths of 15 or more continued in extra
+// bytes. Matches are found through a hash of the next four bytes. Every
+// packet is one block, so it decompresses on its own.
+
+#include "compression.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+// Format rules: the last 5 bytes are literals and no match starts in the
+// last 12 bytes
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static unsigned int hash4(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the continuation bytes of a length that didn't fit in the token.
+// Returns the new output position, or -1 if out is full.
+static int putLength(unsigned char *out, int op, int outCapacity, int length)
+{
+    while (length >= 255)
+    {
+        if (op == outCapacity)
+            return -1;
+        out[op++] = 255;
+        length -= 255;
+    }
+    if (op == outCapacity)
+        return -1;
+    out[op++] = length;
+    return op;
+}
+
+// Writes one sequence: literals, then a match unless matchLength is 0.
+// Returns the new output position, or -1 if out is full.
+static int putSequence(unsigned char *out, int op, int outCapacity, const unsigned char *literals,
+                       int literalLength, int offset, int matchLength)
+{
+    if (op == outCapacity)
+        return -1;
+    int token = op++;
+    int matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    out[token] = (literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15);
+
+    if (literalLength >= 15 && (op = putLength(out, op, outCapacity, literalLength - 15)) < 0)
+        return -1;
+    if (op + literalLength > outCapacity)
+        return -1;
+    memcpy(&out[op], literals, literalLength);
+    op += literalLength;
+
+    if (matchLength == 0)
+        return op;
+    if (op + 2 > outCapacity)
+        return -1;
+    out[op++] = offset & 0xFF;
+    out[op++] = offset >> 8;
+    if (matchCode >= 15 && (op = putLength(out, op, outCapacity, matchCode - 15)) < 0)
+        return -1;
+    return op;
+}
+
+int lzCompress(const unsigned char *data, int size, unsigned char *out, int outCapacity)
+{
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xFF, sizeof(table)); // -1: no position yet
+
+    int ip = 0;
+    int anchor = 0; // First byte not yet written
+    int op = 0;
+
+    while (ip < size - LZ_MATCH_LIMIT)
+    {
+        unsigned int h = hash4(&data[ip]);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(&data[ref], &data[ip], LZ_MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        int length = LZ_MIN_MATCH;
+        int maxLength = size - LZ_LAST_LITERALS - ip;
+        while (length < maxLength && data[ref + length] == data[ip + length])
+            length++;
+        while (ip > anchor && ref > 0 && data[ip - 1] == data[ref - 1])
+        {
+            ip--;
+            ref--;
+            length++;
+        }
+
+        op = putSequence(out, op, outCapacity, &data[anchor], ip - anchor, ip - ref, length);
+        if (op < 0)
+            return -1;
+        ip += length;
+        anchor = ip;
+    }
+
+    return putSequence(out, op, outCapacity, &data[anchor], size - anchor, 0, 0);
+}
+
+int lzDecompress(const unsigned char *data, int size, unsigned char *out, int outCapacity)
+{
+    int ip = 0;
+    int op = 0;
+
+    while (ip < size)
+    {
+        int token = data[ip++];
+
+        int literalLength = token >> 4;
+        if (literalLength == 15)
+        {
+            int extra;
+            do
+            {
+                if (ip == size)
+                    return -1;
+                extra = data[ip++];
+                literalLength += extra;
+            } while (extra == 255);
+        }
+        if (literalLength > size - ip || literalLength > outCapacity - op)
+            return -1;
+        memcpy(&out[op], &data[ip], literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        // The last sequence has no match
+        if (ip == size)
+            break;
+        if (size - ip < 2)
+            return -1;
+        int offset = data[ip] | data[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+
+        int matchLength = (token & 0x0F) + LZ_MIN_MATCH;
+        if ((token & 0x0F) == 15)
+        {
+            int extra;
+            do
+            {
+                if (ip == size)
+                    return -1;
+                extra = data[ip++];
+                matchLength += extra;
+            } while (extra == 255);
+        }
+        if (matchLength > outCapacity - op)
+            return -1;
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (int i = 0; i < matchLength; i++, op++)
+            out[op] = out[op - offset];
+    }
+    return op;
+}
@@ -0,0 +1,121 @@
+// Frame deframer
+
+#include "deframer.h"
+#include "byte_stuffing.h"
+#include "frame_check.h"
+#include <string.h>
+
+void deframerInit(Deframer *d, unsigned char *body, int capacity, LinkLayerFcs fcsType)
+{
+    d->currentState = START_STATE;
+    d->body = body;
+    d->bodySize = 0;
+    d->capacity = capacity;
+    d->escPending = FALSE;
+    d->fcsType = fcsType;
+    d->checkFcs = TRUE;
+    d->fcs = fcsInit(fcsType);
+}
+
+void deframerNext(Deframer *d)
+{
+    d->currentState = FLAG_RCV;
+}
+
+int deframerCheck(const Deframer *d)
+{
+    return !d->escPending && d->bodySize >= fcsSize(d->fcsType) && fcsCheck(d->fcsType, d->fcs);
+}
+
+int deframerPush(Deframer *d, const unsigned char *data, int size)
+{
+    int i = 0;
+
+    while (i < size && d->currentState != STOP_STATE)
+    {
+        switch (d->currentState)
+        {
+        case START_STATE:
+        {
+            // Skip everything up to the next FLAG in one scan
+            const unsigned char *flag = memchr(&data[i], FLAG, size - i);
+            if (flag == NULL)
+                return size;
+            i = flag - data + 1;
+            d->currentState = FLAG_RCV;
+            break;
+        }
+
+        case FLAG_RCV:
+            // Repeated FLAGs are idle fill between frames
+            if (data[i] != FLAG)
+            {
+                d->address = data[i];
+                d->currentState = A_RCV;
+            }
+            i++;
+            break;
+
+        case A_RCV:
+            if (data[i] == FLAG)
+            {
+                d->currentState = FLAG_RCV;
+            }
+            else
+            {
+                d->control = data[i];
+                d->currentState = C_RCV;
+            }
+            i++;
+            break;
+
+        case C_RCV:
+            if (data[i] == FLAG)
+            {
+                d->currentState = FLAG_RCV;
+            }
+            else if (data[i] == (d->address ^ d->control))
+            {
+                d->bodySize = 0;
+                d->escPending = FALSE;
+                d->fcs = fcsInit(d->fcsType);
+                d->currentState = INFO_STATE;
+            }
+            else
+            {
+                d->currentState = START_STATE;
+            }
+            i++;
+            break;
+
+        case INFO_STATE:
+        {
+            // Destuff up to the closing FLAG; every input byte gives at most
+            // one output byte, so limiting the input keeps the body in bounds
+            int limit = size - i;
+            if (limit > d->capacity - d->bodySize)
+                limit = d->capacity - d->bodySize;
+
+            int written;
+            i += destuffBytes(&data[i], limit, &d->body[d->bodySize], &written, &d->escPending, d->fcsType, d->checkFcs ? &d->fcs : NULL);
+            d->bodySize += written;
+
+            if (i < size && data[i] == FLAG)
+            {
+                i++;
+                d->currentState = STOP_STATE;
+            }
+            else if (i < size && d->bodySize == d->capacity)
+            {
+                // Longer than any valid frame: the closing FLAG was lost
+                d->currentState = START_STATE;
+            }
+            break;
+        }
+
+        case STOP_STATE:
+            break;
+        }
+    }
+    return i;
+}
@@ -0,0 +1,199 @@
+// Frame check sequence implementation
+//
+// CRC-16 is the HDLC FCS-16 (CRC-16-CCITT, reflected, RFC 1662) and CRC-32C
+// is the Castagnoli CRC used by iSCSI and SCTP. Both run eight bytes at a
+// time with slice-by-8 tables; CRC-32C uses the SSE4.2 crc32 instruction
+// when the CPU has it.
+
+#include "frame_check.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC16_POLY 0x8408     // 0x1021 reflected
+#define CRC32C_POLY 0x82F63B78 // 0x1EDC6F41 reflected
+
+// Register value left by the data followed by its own (complemented) CRC
+#define CRC16_RESIDUE 0xF0B8
+#define CRC32C_RESIDUE 0xB798B438
+
+static unsigned short crc16Table[8][256];
+static unsigned int crc32cTable[8][256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+static int hasSse42 = FALSE;
+
+// Table k gives the CRC of a byte followed by k zero bytes
+static void buildTables()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        unsigned int crc16 = i;
+        unsigned int crc32 = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc16 = (crc16 & 1) ? (crc16 >> 1) ^ CRC16_POLY : crc16 >> 1;
+            crc32 = (crc32 & 1) ? (crc32 >> 1) ^ CRC32C_POLY : crc32 >> 1;
+        }
+        crc16Table[0][i] = crc16;
+        crc32cTable[0][i] = crc32;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            crc16Table[k][i] = (crc16Table[k - 1][i] >> 8) ^ crc16Table[0][crc16Table[k - 1][i] & 0xFF];
+            crc32cTable[k][i] = (crc32cTable[k - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[k - 1][i] & 0xFF];
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    hasSse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static unsigned int load32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned int crc16Update(unsigned int crc, const unsigned char *data, int size)
+{
+    while (size >= 8)
+    {
+        unsigned int lo = crc ^ load32(data);
+        unsigned int hi = load32(data + 4);
+        crc = crc16Table[7][lo & 0xFF] ^ crc16Table[6][(lo >> 8) & 0xFF] ^
+              crc16Table[5][(lo >> 16) & 0xFF] ^ crc16Table[4][lo >> 24] ^
+              crc16Table[3][hi & 0xFF] ^ crc16Table[2][(hi >> 8) & 0xFF] ^
+              crc16Table[1][(hi >> 16) & 0xFF] ^ crc16Table[0][hi >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+static unsigned int crc32cUpdate(unsigned int crc, const unsigned char *data, int size)
+{
+    while (size >= 8)
+    {
+        unsigned int lo = crc ^ load32(data);
+        unsigned int hi = load32(data + 4);
+        crc = crc32cTable[7][lo & 0xFF] ^ crc32cTable[6][(lo >> 8) & 0xFF] ^
+              crc32cTable[5][(lo >> 16) & 0xFF] ^ crc32cTable[4][lo >> 24] ^
+              crc32cTable[3][hi & 0xFF] ^ crc32cTable[2][(hi >> 8) & 0xFF] ^
+              crc32cTable[1][(hi >> 16) & 0xFF] ^ crc32cTable[0][hi >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static unsigned int crc32cUpdateSse42(unsigned int crc, const unsigned char *data, int size)
+{
+    unsigned long long crc64 = crc;
+    while (size >= 8)
+    {
+        unsigned long long word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = (unsigned int)crc64;
+    while (size-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+int fcsSize(LinkLayerFcs type)
+{
+    switch (type)
+    {
+    case LlFcsCrc16:
+        return 2;
+    case LlFcsCrc32c:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+unsigned int fcsInit(LinkLayerFcs type)
+{
+    pthread_once(&tablesOnce, buildTables);
+
+    switch (type)
+    {
+    case LlFcsCrc16:
+        return 0xFFFF;
+    case LlFcsCrc32c:
+        return 0xFFFFFFFF;
+    default:
+        return 0x00;
+    }
+}
+
+unsigned int fcsUpdate(LinkLayerFcs type, unsigned int fcs, const unsigned char *data, int size)
+{
+    switch (type)
+    {
+    case LlFcsCrc16:
+        return crc16Update(fcs, data, size);
+    case LlFcsCrc32c:
+#if defined(__x86_64__)
+        if (hasSse42)
+            return crc32cUpdateSse42(fcs, data, size);
+#endif
+        return crc32cUpdate(fcs, data, size);
+    default:
+        for (int i = 0; i < size; i++)
+            fcs ^= data[i];
+        return fcs;
+    }
+}
+
+unsigned int fcsUpdateByte(LinkLayerFcs type, unsigned int fcs, unsigned char byte)
+{
+    switch (type)
+    {
+    case LlFcsCrc16:
+        return (fcs >> 8) ^ crc16Table[0][(fcs ^ byte) & 0xFF];
+    case LlFcsCrc32c:
+        return (fcs >> 8) ^ crc32cTable[0][(fcs ^ byte) & 0xFF];
+    default:
+        return fcs ^ byte;
+    }
+}
+
+void fcsFinal(LinkLayerFcs type, unsigned int fcs, unsigned char *out)
+{
+    // CRCs are complemented and sent least significant byte first
+    if (type != LlFcsXor)
+        fcs = ~fcs;
+    for (int i = 0; i < fcsSize(type); i++)
+        out[i] = (fcs >> (8 * i)) & 0xFF;
+}
+
+int fcsCheck(LinkLayerFcs type, unsigned int fcs)
+{
+    switch (type)
+    {
+    case LlFcsCrc16:
+        return fcs == CRC16_RESIDUE;
+    case LlFcsCrc32c:
+        return fcs == CRC32C_RESIDUE;
+    default:
+        return fcs == 0x00;
+    }
+}
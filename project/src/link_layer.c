@@ -1,23 +1,32 @@
 // Link layer protocol implementation
 
-#include "link_layer.h"
-#include "serial_port.h"
-#include <signal.h>
+#include "link_layer_ctx.h"
+#include "byte_stuffing.h"
+#include "deframer.h"
+#include "frame_check.h"
+#include "link_metrics.h"
+#include "reed_solomon.h"
+#include "serial_port_ctx.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <string.h>
-#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <time.h>
-extern time_t start, end;
-
-int totalPacketsRead = 0;
+#include <unistd.h>
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
 #define CTRL_BUF_SIZE 5
 
-// trama Bytes
-#define FLAG 0X7E
+// trama Bytes (FLAG and ESC come from byte_stuffing.h)
 
 #define ESCFLAG 0X5E
 #define ESCESC 0X5D
@@ -26,10 +35,20 @@ int totalPacketsRead = 0;
 
 #define ADDRESS_RX 0X01
 #define ADDRESS_TX 0X03
+// Every frame carries the address of the side that sends it, so on a duplex
+// link each side tells its own I-frames and acknowledgments from the other's
+#define LOCAL_ADDRESS(ctx) ((ctx)->cp.role == LlTx ? ADDRESS_TX : ADDRESS_RX)
+#define PEER_ADDRESS(ctx) ((ctx)->cp.role == LlTx ? ADDRESS_RX : ADDRESS_TX)
+// Frames of logical channel n carry n in bits 2-3 of the address. Bit 4 stays
+// clear, so neither the address nor BCC1 can be FLAG or ESC. SET, UA and DISC
+// belong to channel 0.
+#define CHANNEL_ADDRESS(address, channel) ((unsigned char)((address) | ((channel) << 2)))
+#define ADDRESS_SENDER(address) ((address) & 0x03)
+#define ADDRESS_CHANNEL(address) ((address) >> 2)
+#define LOCAL_CHANNEL_ADDRESS(ctx, ch) CHANNEL_ADDRESS(LOCAL_ADDRESS(ctx), (ch)->id)
 #define UA 0X07
 #define SET 0X03
 #define DISC 0x0B
-#define ESC 0x7D
 #define C0 0x00
 #define C1 0x80
 
@@ -41,13 +60,43 @@ int totalPacketsRead = 0;
 #define RR_RECEIVED 1
 #define REJ_RECEIVED -4
 
-static int sequenceNumber = 0;
-unsigned char sequenceChar = C1;
-int isValid = FALSE;
-int isRepeated = FALSE;
-static int escCheck = FALSE;
-
-long int bytesRead = 0;
+// Windowed ARQ control bytes (HDLC normal mode, sequence numbers modulo 8)
+// I:   0 | N(S) << 1 | N(R) << 5
+// RR:  0x01 | N(R) << 5
+// REJ: 0x09 | N(R) << 5
+// SREJ: 0x0D | N(R) << 5
+// None of these (nor their BCC1) can be FLAG or ESC, so the header stays unstuffed.
+// I-frames carry N(R) only on a duplex link; otherwise it is 0.
+#define SEQ_MODULUS 8
+#define I_FRAME(ns) ((unsigned char)((ns) << 1))
+#define I_FRAME_NR(ns, nr) ((unsigned char)(I_FRAME(ns) | ((nr) << 5)))
+#define RR_N(nr) ((unsigned char)(0x01 | ((nr) << 5)))
+#define REJ_N(nr) ((unsigned char)(0x09 | ((nr) << 5)))
+#define SREJ_N(nr) ((unsigned char)(0x0D | ((nr) << 5)))
+#define IS_I_FRAME(c) (((c) & 0x01) == 0x00)
+#define IS_S_FRAME(c) (((c) & 0x03) == 0x01)
+#define S_FRAME_TYPE(c) ((c) & 0x1F)
+#define FRAME_NS(c) (((c) >> 1) & 0x07)
+#define FRAME_NR(c) (((c) >> 5) & 0x07)
+
+// SET/UA negotiation parameters (type | length | value), sent after BCC1
+// and protected by a BCC2 like an I-frame
+#define PARAM_ARQ 0x01
+#define PARAM_WINDOW 0x02
+#define PARAM_FCS 0x03
+#define PARAM_PAYLOAD 0x04 // Two bytes, most significant first
+#define PARAM_FEC 0x05
+#define PARAM_DUPLEX 0x06
+#define PARAM_CHANNELS 0x07
+#define PARAM_RESUME 0x08 // Fingerprint and offset, four bytes each, most significant first
+#define MAX_PARAMS_SIZE 48
+
+// The base stop-and-wait protocol, every optional feature off
+#define BASE_OPTIONS {.arq = LlStopAndWait, .windowSize = 1, .fcs = LlFcsXor, .maxPayloadSize = MAX_PAYLOAD_SIZE, \
+                      .readTimeout = 1, .channels = 1, .metricsFormat = LlMetricsJson}
+
+// Outages whose downtime is listed in the statistics
+#define MAX_OUTAGES_SHOWN 16
 
 // C
 // 00000000 / 0x00 Information frame number 0
@@ -59,917 +108,2692 @@ typedef struct{
     int framesReceived;
     int framesRetransmitted;
     int errorFrames;
+    int framesSelectiveRetransmitted;
+    int selectiveRejects;
+    int timeouts;
+    int rejectsReceived;
+    long fecDataBytes;   // Body bytes protected by FEC
+    long fecParityBytes; // Parity bytes added to them
+    int fecRepairedFrames;
+    int fecCorrectedBytes;
+    int piggybackedAcks; // Duplex: acknowledgments carried by I-frames
+    int channelFramesSent[LL_MAX_CHANNELS]; // New I-frames of each channel
+    int channelPacketsRead[LL_MAX_CHANNELS];
+    int outages;        // Reconnect: times the retry limit was reached
+    long downtimeMicros; // Reconnect: of all the outages
+    long outageMicros[MAX_OUTAGES_SHOWN]; // Reconnect: of each of the first outages
+    long wireBytesSent;     // Everything written to the serial port
+    long wireBytesReceived; // Everything read from it
+    long iFramesBuilt;      // I-frames framed, retransmissions not included
+    long frameBytes;        // Their size before stuffing
+    long stuffedFrameBytes; // And after
+    long payloadBytesAcked;
+    LatencyHistogram ackLatency; // First transmission to acknowledgment
 } transmitionStats;
 
-transmitionStats stats = {0,0,0,0};
+// DATA | FCS of an I-frame, with the Reed-Solomon parity when FEC is agreed
+#define BODY_SIZE(payloadSize, fecParity) FEC_ENCODED_SIZE((payloadSize) + MAX_FCS_SIZE, fecParity)
+// Worst case stuffed I-frame: header, every body byte escaped, FLAG
+#define STUFFED_FRAME_SIZE(bodySize) (4 + 2 * (bodySize) + 1)
+
+typedef struct
+{
+    unsigned char *frame; // Stuffed I-frame kept until acknowledged
+    int size;
+    int payloadSize;
+    long sentAt;       // First transmission, in microseconds
+    int retransmitted; // Not used for RTT samples (Karn's rule)
+    int async;         // Framed from an asynchronous write
+} WindowSlot;
+
+// Selective Repeat reorder buffer, indexed by sequence number
+typedef struct
+{
+    unsigned char *data; // Payload received ahead of a missing frame
+    int size;
+    int received;
+    int srejSent; // SREJ already sent for this missing frame
+    int dropped;  // Dropped beyond the receive window, see resumeDropped
+} ReorderSlot;
+
+#define OUTCOME_HISTORY 32 // Frame transmissions the error rate is measured over
+
+typedef struct
+{
+    int frameBytes[OUTCOME_HISTORY];
+    unsigned char failed[OUTCOME_HISTORY];
+    int count;      // Entries in use
+    int next;       // Oldest entry, overwritten next
+    int sinceAdapt; // Entries added since the last adaptPayloadSize
+} OutcomeHistory;
+
+#define RX_CHUNK_SIZE 1024
+
+// Asynchronous write or read waiting in its channel
+typedef struct
+{
+    struct iovec iov;      // Write: the data to send
+    unsigned char *packet; // Read: where the packet goes
+    int result;            // Write: size of its I-frame once framed
+    LinkLayerCallback done;
+    void *userData;
+} AsyncRequest;
+
+// Sequence numbers, window and received frames of one logical channel.
+// Stop-and-wait only uses channel 0.
+typedef struct
+{
+    int id;
+    int sequenceNumber; // Next frame to deliver (0 or 1 with stop-and-wait)
+
+    WindowSlot window[SEQ_MODULUS];
+    ReorderSlot reorder[SEQ_MODULUS];
+
+    int windowBase;  // Oldest unacknowledged sequence number
+    int nextSeq;     // Sequence number of the next new I-frame
+    int outstanding; // I-frames in the window and not yet acknowledged
+    int sent;        // The first ones of them, already given to the line
+    int rejSent;     // Receiver already asked for a retransmission
+    int ackPending;  // A frame waiting for llread is not acknowledged yet
+    int rxDropped;   // A frame was dropped for want of room, see resumeDropped
+
+    // Retransmission timer of the window, see armWindowTimer
+    long deadline; // Microseconds
+    int alarmEnabled;
+    int alarmCount;
+
+    // Asynchronous requests, oldest first. The first writesFramed writes are
+    // in the window, and the first writesAcked of them were acknowledged.
+    AsyncRequest writes[LL_MAX_ASYNC_REQUESTS];
+    int writesFirst;
+    int writesCount;
+    int writesFramed;
+    int writesAcked;
+    AsyncRequest reads[LL_MAX_ASYNC_REQUESTS];
+    int readsFirst;
+    int readsCount;
+} LinkChannel;
+
+// Packets between the application and the link thread, see ioThreadWrite.
+// The indexes run freely and are taken modulo LL_MAX_ASYNC_REQUESTS.
+typedef struct
+{
+    unsigned char *data[LL_MAX_ASYNC_REQUESTS];
+    int size[LL_MAX_ASYNC_REQUESTS];
+    atomic_uint head; // Next packet the consumer takes
+    atomic_uint tail; // Next slot the producer fills
+} PacketRing;
+
+// With several channels, the I-frames are given to the line no earlier than
+// this before it finishes the previous ones (at the baud rate), so a frame
+// of one channel never queues behind a burst of another's
+#define LINE_LEAD_MICROS 2000
+
+// State of one link. Every function below works on the link it is given, so
+// links on different serial ports can run side by side, one per thread.
+struct LinkLayerCtx
+{
+    LinkLayer cp;
+    LinkLayerOptions options; // Requested when opening
+    LinkLayerOptions agreed;  // Negotiated when opening
+    SerialPort port;
+    long openedAt; // In microseconds, see nowMicros
+    long nextMetricsAt; // When the telemetry is written next, 0 if only by llclose (see armTimer)
+
+    unsigned char sequenceChar;
+    int isValid;
+    int isRepeated;
+    long int bytesRead;
+    int totalPacketsRead;
+    transmitionStats stats;
+
+    unsigned char ctrlParams[MAX_PARAMS_SIZE + 1]; // Parameters of the last SET/UA (and its BCC2 while received)
+    int ctrlParamsLength;
+
+    // Frame buffers, set up once per link when opening (see allocFrameBuffers)
+    int maxPayloadSize;
+    unsigned char *rxMessage; // Destuffed body of the I-frame being received
+    LinkChannel channels[LL_MAX_CHANNELS];
+
+    long retransmissionTimeout; // Microseconds
+    long srtt;   // Smoothed round-trip time in microseconds, 0 before the first sample
+    long rttvar; // Round-trip time variation
+
+    long outageStart;   // Reconnect: when the link went down, 0 while it is up
+    long outageTimeout; // Reconnect: retransmission timeout before the outage
+
+    OutcomeHistory history;
+    int payloadTarget; // Payload size suggested to the application
+
+    // One-shot timerfd, waited on together with the serial port in receiveFrame.
+    // Supervision frames and stop-and-wait use it directly; the channels'
+    // windows each have their own deadline and share it (windowTimer).
+    int timerFd;
+    long alarmDeadline; // Of the alarm the timer is armed for, 0 if none
+    int alarmCount;
+    int alarmEnabled;
+    int alarmDeferred; // Expired while bytes were waiting, handled after them
+    int windowTimer;
+
+    long lineFreeAt; // When the line will have sent the I-frames given to it
+    int sendTurn;    // Channel the scheduler looks at first
+    int readTurn;    // Channel llreadany looks at first
+
+    Deframer deframer;
+    unsigned char rxChunk[RX_CHUNK_SIZE]; // Bytes read from the port
+    int rxChunkPosition;                  // First byte not yet deframed
+    int rxChunkSize;
+
+    // Duplex, several channels or asynchronous requests: received I-frames
+    // wait in their channel's reorder until llread takes them
+    int discReceived; // The other side asked to disconnect
+
+    // Asynchronous interface, set up by the first request (see enableAsync)
+    int asyncIo;
+    int pollFd; // epoll descriptor watching the serial port, timerFd and wakeFd
+    int wakeFd; // eventfd, written when a request is queued
+
+    // Link thread, started by the ioThread option (see startIoThread)
+    int ioThread;
+    pthread_t ioThreadId;
+    atomic_int ioStop;
+    atomic_int ioWriteFailed; // A packet of txRing could not be sent
+    PacketRing txRing; // Filled by the application
+    PacketRing rxRing; // Filled by the link thread
+    unsigned int txSubmitted; // Link thread: packets of txRing given to the link
+    unsigned int rxPosted;    // Link thread: slots of rxRing given to the link
+    int linkWakeFd; // eventfd, written by the application after using a ring
+    int appWakeFd;  // eventfd, written by the link thread
+
+#ifdef LL_NO_HEAP
+    // Frame buffers reserved with the link, for MAX_PAYLOAD_SIZE
+    unsigned char rxMessageStorage[BODY_SIZE(MAX_PAYLOAD_SIZE, MAX_FEC_PARITY)];
+    // Only for channel 0, see clampOptions
+    unsigned char windowStorage[SEQ_MODULUS][STUFFED_FRAME_SIZE(BODY_SIZE(MAX_PAYLOAD_SIZE, MAX_FEC_PARITY))];
+    unsigned char reorderStorage[SEQ_MODULUS][MAX_PAYLOAD_SIZE + MAX_FCS_SIZE];
+    int inUse; // Handed out by ll_open_ctx
+#endif
+};
 
 ////////////////////////////////////////////////
-// Alarm Handler
+// Round-trip time estimation
 ////////////////////////////////////////////////
 
-int alarmCount = 0;
-int alarmEnabled = FALSE;
-void alarmHandler(int signal)
+// Bounds of the estimated retransmission timeout, in microseconds
+#define RTO_MIN 10000
+#define RTO_MAX 60000000
+// Longest wait between two probes of a lost link (see linkDown)
+#define PROBE_INTERVAL_MAX 2000000
+
+long nowMicros()
 {
-    alarmEnabled = FALSE;
-    alarmCount++;
-    printf("Alarm #%d\n", alarmCount);
-};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
 
-void resetAlarm()
+// Adds the round-trip time of a frame sent only once (Karn's rule) to the
+// estimate and derives the retransmission timeout from it (RFC 6298)
+void sampleRtt(LinkLayerCtx *ctx, long rtt)
 {
-    alarmCount = 0;
-    alarmEnabled = FALSE;
+    if (ctx->options.fixedTimeout)
+        return;
+
+    if (ctx->srtt == 0)
+    {
+        ctx->srtt = rtt;
+        ctx->rttvar = rtt / 2;
+    }
+    else
+    {
+        long delta = ctx->srtt > rtt ? ctx->srtt - rtt : rtt - ctx->srtt;
+        ctx->rttvar = (3 * ctx->rttvar + delta) / 4;
+        ctx->srtt = (7 * ctx->srtt + rtt) / 8;
+    }
+
+    ctx->retransmissionTimeout = ctx->srtt + 4 * ctx->rttvar;
+    if (ctx->retransmissionTimeout < RTO_MIN)
+        ctx->retransmissionTimeout = RTO_MIN;
+    if (ctx->retransmissionTimeout > RTO_MAX)
+        ctx->retransmissionTimeout = RTO_MAX;
 }
 
-// returns 1 if BCC2 is correct
-int checkBCC2(unsigned char message[], int charsRead, unsigned char bcc2_byte)
+// Doubles the retransmission timeout after it expired, until the next sample
+void backoffRtt(LinkLayerCtx *ctx)
 {
-    unsigned char BCC2 = 0x00;
-    for (int i = 0; i <= charsRead; i++)
+    // Probes for a lost link back off even with a fixed timeout
+    if (ctx->outageStart != 0)
     {
-        BCC2 ^= message[i];
+        ctx->retransmissionTimeout *= 2;
+        if (ctx->retransmissionTimeout > PROBE_INTERVAL_MAX)
+            ctx->retransmissionTimeout = PROBE_INTERVAL_MAX;
+        return;
     }
-    return BCC2 == bcc2_byte;
+    if (ctx->options.fixedTimeout)
+        return;
+
+    ctx->retransmissionTimeout *= 2;
+    if (ctx->retransmissionTimeout > RTO_MAX)
+        ctx->retransmissionTimeout = RTO_MAX;
 }
 
 ////////////////////////////////////////////////
-// State Machine
+// Link outages
 ////////////////////////////////////////////////
 
-typedef enum
-{
-    START_STATE,
-    FLAG_RCV,
-    A_RCV,
-    C_RCV,
-    BCC_RCV,
-    INFO_STATE,
-    STOP_STATE
-} StateType;
-
-typedef struct
+// The retry limit was reached. Without the reconnect option the process ends;
+// with it the link is taken as down and the unacknowledged I-frames keep
+// going out as probes, the timeout doubling up to PROBE_INTERVAL_MAX, until
+// the other side answers or reconnectSeconds have passed. Sequence numbers
+// and windows are kept, so the transfer carries on where it stopped.
+void linkDown(LinkLayerCtx *ctx)
 {
-    StateType currentState; // Current state of the state machine
-} StateMachine;
+    if (ctx->options.reconnectSeconds <= 0)
+    {
+        printf("Maximum retransmissions reached. Exiting...\n");
+        exit(-1);
+    }
+    long now = nowMicros();
+    if (ctx->outageStart == 0)
+    {
+        printf("Maximum retransmissions reached. Link down, probing...\n");
+        ctx->outageStart = now;
+        ctx->outageTimeout = ctx->retransmissionTimeout;
+        ctx->stats.outages++;
+    }
+    else if (now - ctx->outageStart > ctx->options.reconnectSeconds * 1000000L)
+    {
+        printf("Link down for %d seconds. Exiting...\n", ctx->options.reconnectSeconds);
+        exit(-1);
+    }
+}
 
-void transition(StateMachine *sm, StateType newState)
+// A frame arrived: a lost link is back up
+void linkRestored(LinkLayerCtx *ctx)
 {
-    sm->currentState = newState;
+    if (ctx->outageStart == 0)
+        return;
+    long downtime = nowMicros() - ctx->outageStart;
+    printf("Link restored after %.1f seconds\n", downtime / 1000000.0);
+    ctx->stats.downtimeMicros += downtime;
+    if (ctx->stats.outages <= MAX_OUTAGES_SHOWN)
+        ctx->stats.outageMicros[ctx->stats.outages - 1] = downtime;
+    ctx->outageStart = 0;
+    ctx->retransmissionTimeout = ctx->outageTimeout;
+
+    // The retry limit applies afresh
+    ctx->alarmCount = 0;
+    for (int i = 0; i < ctx->agreed.channels; i++)
+        ctx->channels[i].alarmCount = 0;
 }
 
-int processInfoByte(StateMachine *sm, unsigned char address, unsigned char control, unsigned char curr_byte, unsigned char **buffer, int *bufferPosition, unsigned char **message, int *charsRead)
-{
-    // Array of possible RR and REJ control bytes
-    switch (sm->currentState)
-    {
-    case BCC_RCV:
-        transition(sm, INFO_STATE);
-        break;
-    case START_STATE:
-        *bufferPosition = 0; // Reset buffer position at the start
-        if (curr_byte == FLAG)
-        {
-            (*bufferPosition)++;
-            *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-            if (*buffer == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
-            (*buffer)[(*bufferPosition) - 1] = curr_byte;
-            transition(sm, FLAG_RCV);
-        }
-        break;
+////////////////////////////////////////////////
+// Telemetry
+////////////////////////////////////////////////
 
-    case FLAG_RCV:
-        if (curr_byte == address)
-        {
-            (*bufferPosition)++;
-            *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
+// Writes a snapshot of the link's counters to the metrics file, and
+// schedules the next one during the transfer
+void reportMetrics(LinkLayerCtx *ctx, int final)
+{
+    long now = nowMicros();
+    LinkMetrics m;
+    memset(&m, 0, sizeof(m));
+    m.role = ctx->cp.role == LlTx ? "tx" : "rx";
+    m.port = ctx->cp.serialPort;
+    m.final = final;
+    m.elapsedSeconds = (now - ctx->openedAt) / 1000000.0;
+    m.baudRate = ctx->cp.baudRate;
+    m.framesSent = ctx->stats.framesSent;
+    m.framesReceived = ctx->stats.framesReceived;
+    m.framesRetransmitted = ctx->stats.framesRetransmitted;
+    m.errorFrames = ctx->stats.errorFrames;
+    m.timeouts = ctx->stats.timeouts;
+    m.rejectsReceived = ctx->stats.rejectsReceived;
+    m.selectiveRejects = ctx->stats.selectiveRejects;
+    m.outages = ctx->stats.outages;
+    m.downtimeSeconds = (ctx->stats.downtimeMicros + (ctx->outageStart != 0 ? now - ctx->outageStart : 0)) / 1000000.0;
+    m.wireBytesSent = ctx->stats.wireBytesSent;
+    m.wireBytesReceived = ctx->stats.wireBytesReceived;
+    m.payloadBytesSent = ctx->stats.payloadBytesAcked;
+    m.payloadBytesReceived = ctx->bytesRead;
+    m.frameBytes = ctx->stats.frameBytes;
+    m.stuffedFrameBytes = ctx->stats.stuffedFrameBytes;
+    m.newFramesSent = ctx->stats.iFramesBuilt;
+    m.srttSeconds = ctx->srtt / 1000000.0;
+    m.ackLatency = ctx->stats.ackLatency;
+    writeMetrics(ctx->options.metricsFile, ctx->options.metricsFormat, &m);
+
+    if (ctx->nextMetricsAt != 0)
+        ctx->nextMetricsAt = now + ctx->options.metricsIntervalMicros;
+}
 
-            if (*buffer == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
+////////////////////////////////////////////////
+// Adaptive frame size
+////////////////////////////////////////////////
 
-            (*buffer)[(*bufferPosition) - 1] = curr_byte;
-            transition(sm, A_RCV);
-        }
-        else if (curr_byte == FLAG)
-        {
+#define ADAPT_INTERVAL 8 // Transmissions between payload size increases
+#define MIN_ADAPTIVE_PAYLOAD 64
 
-            transition(sm, FLAG_RCV);
-        }
-        else
-        {
-            transition(sm, START_STATE);
-        }
-        break;
+double powInt(double base, int exponent)
+{
+    double result = 1.0;
+    while (exponent > 0)
+    {
+        if (exponent & 1)
+            result *= base;
+        base *= base;
+        exponent >>= 1;
+    }
+    return result;
+}
 
-    case A_RCV:
-        if (curr_byte == C0 || curr_byte == C1)
-        {
-            if (curr_byte == sequenceChar)
-            {
-                isRepeated = TRUE;
-            }
-            else
-            {
-                isRepeated = FALSE;
-            }
-            (*bufferPosition)++;
-            *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-            if (*buffer == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
-            (*buffer)[(*bufferPosition) - 1] = curr_byte;
-            transition(sm, C_RCV);
-        }
-        else if (curr_byte == FLAG)
-        {
+// Expected share of the line carrying payload with frames of payloadSize
+// bytes, when each byte gets through with probability byteSuccess
+double frameEfficiency(int payloadSize, int overhead, double byteSuccess)
+{
+    return (double)payloadSize / (payloadSize + overhead) * powInt(byteSuccess, payloadSize + overhead);
+}
 
-            transition(sm, FLAG_RCV);
-        }
-        else
-        {
-            transition(sm, START_STATE);
-        }
-        break;
-    case C_RCV:
+// Moves the suggested payload size toward the most efficient one for the
+// error rate seen over the outcome history
+void adaptPayloadSize(LinkLayerCtx *ctx)
+{
+    int failures = 0;
+    long bytes = 0;
+    for (int i = 0; i < ctx->history.count; i++)
+    {
+        failures += ctx->history.failed[i];
+        bytes += ctx->history.frameBytes[i];
+    }
+    int meanFrame = bytes / ctx->history.count;
 
-        if (curr_byte == ((*buffer)[1] ^ (*buffer)[2]))
-        {
-            (*bufferPosition)++;
-            *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-            if (*buffer == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
-            (*buffer)[(*bufferPosition) - 1] = curr_byte;
-            transition(sm, INFO_STATE);
-        }
-        else if (curr_byte == FLAG)
-        {
-            transition(sm, FLAG_RCV);
-        }
+    // Per-byte success probability behind the observed frame success rate
+    double frameSuccess = failures == ctx->history.count ? 0.5 / ctx->history.count : 1.0 - (double)failures / ctx->history.count;
+    double low = 0.0, high = 1.0;
+    for (int i = 0; i < 50; i++)
+    {
+        double mid = (low + high) / 2;
+        if (powInt(mid, meanFrame) < frameSuccess)
+            low = mid;
         else
-        {
-            transition(sm, START_STATE);
-        }
-        break;
+            high = mid;
+    }
 
-    case INFO_STATE:
-        if ((curr_byte != ESCFLAG && curr_byte != ESCESC) && escCheck)
+    // Header, FCS, closing FLAG and the acknowledgment are paid per frame
+    int overhead = 4 + fcsSize(ctx->agreed.fcs) + 1 + CTRL_BUF_SIZE;
+    int best = MIN_ADAPTIVE_PAYLOAD;
+    double bestEfficiency = 0.0;
+    for (double size = MIN_ADAPTIVE_PAYLOAD;; size *= 1.19) // About 2^(1/4) apart
+    {
+        int candidate = size < ctx->maxPayloadSize ? (int)size : ctx->maxPayloadSize;
+        double efficiency = frameEfficiency(candidate, overhead, high);
+        if (efficiency > bestEfficiency)
         {
-            (*bufferPosition)++;
-            *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-            if (*buffer == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
-            (*buffer)[(*bufferPosition) - 1] = ESC;
-
-            (*charsRead)++;
-            *message = (unsigned char *)realloc(*message, *charsRead);
-            if (*message == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
-            (*message)[(*charsRead) - 1] = ESC;
-            escCheck = FALSE;
+            bestEfficiency = efficiency;
+            best = candidate;
         }
-        switch (curr_byte)
-        {
-        case FLAG:
-            if (!escCheck)
-                transition(sm, STOP_STATE);
+        if (candidate == ctx->maxPayloadSize)
             break;
-        case ESCFLAG:
-            if (escCheck)
-            {
-                (*bufferPosition)++;
-                *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-                if (*buffer == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*buffer)[(*bufferPosition) - 1] = FLAG;
-
-                (*charsRead)++;
-                *message = (unsigned char *)realloc(*message, *charsRead);
-                if (*message == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*message)[(*charsRead) - 1] = FLAG;
-
-                escCheck = FALSE;
-            }
-            else
-            {
+    }
 
-                (*bufferPosition)++;
-                *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-                if (*buffer == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*buffer)[(*bufferPosition) - 1] = ESCFLAG;
+    // At most a factor of two per step, so one bad burst doesn't swing it
+    int previous = ctx->payloadTarget;
+    if (best > ctx->payloadTarget)
+        ctx->payloadTarget = best < 2 * ctx->payloadTarget ? best : 2 * ctx->payloadTarget;
+    else
+        ctx->payloadTarget = best > ctx->payloadTarget / 2 ? best : ctx->payloadTarget / 2;
+    if (ctx->payloadTarget != previous)
+        printf("Frame payload %d -> %d bytes (%d of the last %d frames failed)\n", previous, ctx->payloadTarget, failures, ctx->history.count);
+}
 
-                (*charsRead)++;
-                *message = (unsigned char *)realloc(*message, *charsRead);
-                if (*message == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*message)[(*charsRead) - 1] = ESCFLAG;
+// Records whether a transmission of an I-frame got through
+void recordFrameOutcome(LinkLayerCtx *ctx, int frameBytes, int failed)
+{
+    if (!ctx->options.adaptivePayload)
+        return;
 
-                escCheck = FALSE;
-            }
-            break;
-        case ESCESC:
-            if (escCheck)
-            {
-                (*bufferPosition)++;
-                *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-                if (*buffer == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*buffer)[(*bufferPosition) - 1] = ESC;
+    ctx->history.frameBytes[ctx->history.next] = frameBytes;
+    ctx->history.failed[ctx->history.next] = failed;
+    ctx->history.next = (ctx->history.next + 1) % OUTCOME_HISTORY;
+    if (ctx->history.count < OUTCOME_HISTORY)
+        ctx->history.count++;
 
-                (*charsRead)++;
-                *message = (unsigned char *)realloc(*message, *charsRead);
-                if (*message == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*message)[(*charsRead) - 1] = ESC;
+    // Failures are acted on at once, growing waits for a clean stretch
+    if (++ctx->history.sinceAdapt >= ADAPT_INTERVAL || failed)
+    {
+        ctx->history.sinceAdapt = 0;
+        adaptPayloadSize(ctx);
+    }
+}
 
-                escCheck = FALSE;
-            }
-            else
-            {
-                (*bufferPosition)++;
-                *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-                if (*buffer == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*buffer)[(*bufferPosition) - 1] = ESCESC;
+// Starts from the base frame size: a frame too big for the line could never
+// get through, since a frame already built is resent as it is
+void resetPayloadAdaptation(LinkLayerCtx *ctx)
+{
+    memset(&ctx->history, 0, sizeof(ctx->history));
+    ctx->payloadTarget = ctx->maxPayloadSize < MAX_PAYLOAD_SIZE ? ctx->maxPayloadSize : MAX_PAYLOAD_SIZE;
+}
 
-                (*charsRead)++;
-                *message = (unsigned char *)realloc(*message, *charsRead);
-                if (*message == NULL)
-                {
-                    printf("Memory allocation failed\n");
-                    exit(-1);
-                }
-                (*message)[(*charsRead) - 1] = ESCESC;
-                escCheck = FALSE;
-            }
-            break;
-        case ESC:
-            escCheck = TRUE;
-            break;
-        default:
-            (*bufferPosition)++;
-            *buffer = (unsigned char *)realloc(*buffer, *bufferPosition);
-            if (*buffer == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
-            (*buffer)[(*bufferPosition) - 1] = curr_byte;
+////////////////////////////////////////////////
+// Retransmission timer
+////////////////////////////////////////////////
 
-            (*charsRead)++;
-            *message = (unsigned char *)realloc(*message, *charsRead);
-            if (*message == NULL)
-            {
-                printf("Memory allocation failed\n");
-                exit(-1);
-            }
-            (*message)[(*charsRead) - 1] = curr_byte;
-            break;
-        }
-        break;
+// Time the line takes for bytes (10 bits a byte)
+long lineMicros(LinkLayerCtx *ctx, long bytes)
+{
+    return ctx->cp.baudRate > 0 ? bytes * LINE_BITS_PER_BYTE * 1000000 / ctx->cp.baudRate : 0;
+}
 
-    case STOP_STATE:
-        // checks condition
+// Arms the timer for the alarm or, if it comes first, the next periodic
+// telemetry snapshot, so snapshots are written even while the line is quiet
+void armTimer(LinkLayerCtx *ctx)
+{
+    long next = ctx->alarmDeadline;
+    if (ctx->nextMetricsAt != 0 && (next == 0 || ctx->nextMetricsAt < next))
+        next = ctx->nextMetricsAt;
 
-        isValid = checkBCC2(*message, (*charsRead) - 2, (*buffer)[(*bufferPosition) - 1]);
-        return 0;
-        break;
+    struct itimerspec timeout = {0};
+    if (next != 0)
+    {
+        long micros = next - nowMicros();
+        if (micros < 1)
+            micros = 1;
+        timeout.it_value.tv_sec = micros / 1000000;
+        timeout.it_value.tv_nsec = (micros % 1000000) * 1000;
     }
-    return -1;
+    timerfd_settime(ctx->timerFd, 0, &timeout, NULL);
 }
 
-int processCtrlByte(StateMachine *sm, StateType address, unsigned char control, unsigned char curr_byte, unsigned char buffer[], int *bufferPosition)
+void setTimer(LinkLayerCtx *ctx, long micros)
 {
-    switch (sm->currentState)
-    {
-
-    case START_STATE:
-        *bufferPosition = 0; // Reset buffer position at the start
-        if (curr_byte == FLAG)
-        {
-            buffer[(*bufferPosition)++] = curr_byte; // Store FLAG
-            transition(sm, FLAG_RCV);
-        }
-        break;
-
-    case FLAG_RCV:
-        if (curr_byte == address)
-        {
-            buffer[(*bufferPosition)++] = curr_byte; // Store ADDRESS_RX
-            transition(sm, A_RCV);
-        }
-        else if (curr_byte == FLAG)
-        {
-            *bufferPosition = 0;                     // Reset buffer position when a new FLAG is received
-            buffer[(*bufferPosition)++] = curr_byte; // Store FLAG
-            transition(sm, FLAG_RCV);
-        }
-        else
-        {
-            transition(sm, START_STATE);
-        }
-        break;
-
-    case A_RCV:
-
-        if (curr_byte == control || (((curr_byte == RR0) || (curr_byte == RR1) || (curr_byte == REJ0) || (curr_byte == REJ1)) && control == IControlByte)) // curr_byte == (RR0 || RR1 || REJ0 || REJ1)
-        {
-            buffer[(*bufferPosition)++] = curr_byte; // Store CONTROL
-            transition(sm, C_RCV);
-        }
-        else if (curr_byte == FLAG)
-        {
-            *bufferPosition = 0;                     // Reset buffer position when a new FLAG is received
-            buffer[(*bufferPosition)++] = curr_byte; // Store FLAG
-            transition(sm, FLAG_RCV);
-        }
-        else
-        {
-            return 0;
-        }
-        break;
+    ctx->alarmDeadline = micros > 0 ? nowMicros() + micros : 0;
+    ctx->alarmEnabled = micros > 0;
+    ctx->alarmDeferred = FALSE;
+    armTimer(ctx);
+}
 
-    case C_RCV:
-        if (curr_byte == (buffer[1] ^ buffer[2]))
-        {
-            buffer[(*bufferPosition)++] = curr_byte; // Store BCC
-            transition(sm, BCC_RCV);
-        }
-        else if (curr_byte == FLAG)
-        {
-            *bufferPosition = 0;                     // Reset buffer position when a new FLAG is received
-            buffer[(*bufferPosition)++] = curr_byte; // Store FLAG
-            transition(sm, FLAG_RCV);
-        }
-        else
-        {
-            transition(sm, START_STATE);
-        }
-        break;
+// Arms the timer for one retransmission timeout
+void startAlarm(LinkLayerCtx *ctx)
+{
+    setTimer(ctx, ctx->retransmissionTimeout);
+    ctx->windowTimer = FALSE;
+}
 
-    case BCC_RCV:
-        if (curr_byte == FLAG)
-        {
+void stopAlarm(LinkLayerCtx *ctx)
+{
+    setTimer(ctx, 0);
+    ctx->windowTimer = FALSE;
+}
 
-            buffer[(*bufferPosition)++] = curr_byte; // Store FLAG
-            transition(sm, STOP_STATE);
-            return 0;
-        }
-        else
-        {
-            transition(sm, START_STATE);
-        }
-        break;
+void resetAlarm(LinkLayerCtx *ctx)
+{
+    stopAlarm(ctx);
+    ctx->alarmCount = 0;
+}
 
-    case STOP_STATE:
+// Arms the timer for the earliest deadline of the channels' windows, or for
+// when the line can take the next queued I-frame on a paced link
+void armWindowTimer(LinkLayerCtx *ctx)
+{
+    long next = 0;
+    for (int i = 0; i < ctx->agreed.channels; i++)
     {
-        return 0;
-        break;
+        LinkChannel *ch = &ctx->channels[i];
+        if (ch->alarmEnabled && (next == 0 || ch->deadline < next))
+            next = ch->deadline;
+        if (ctx->agreed.channels > 1 && ch->outstanding > ch->sent &&
+            (next == 0 || ctx->lineFreeAt - LINE_LEAD_MICROS < next))
+            next = ctx->lineFreeAt - LINE_LEAD_MICROS;
     }
 
-    default:
-        break;
+    long micros = 0;
+    if (next != 0)
+    {
+        micros = next - nowMicros();
+        if (micros < 1)
+            micros = 1;
     }
-    return -1;
+    setTimer(ctx, micros);
+    ctx->windowTimer = micros > 0;
 }
 
-void buildCtrlWord(unsigned char address, unsigned char control)
+// Time the line takes for the I-frames of the channel given to it and not yet
+// acknowledged. Without pacing they are all written at once, so the last
+// ones may still wait for the line.
+long queuedLineMicros(LinkLayerCtx *ctx, LinkChannel *ch)
 {
+    long bytes = 0;
+    for (int i = 0; i < ch->sent; i++)
+        bytes += ch->window[(ch->windowBase + i) % SEQ_MODULUS].size;
+    return lineMicros(ctx, bytes);
+}
 
-    unsigned char buf[CTRL_BUF_SIZE] = {0};
+// Starts the window timer of the channel: one retransmission timeout, plus
+// the time the line needs for its I-frames still queued for it
+void startChannelAlarm(LinkLayerCtx *ctx, LinkChannel *ch)
+{
+    ch->deadline = nowMicros() + ctx->retransmissionTimeout + queuedLineMicros(ctx, ch);
+    ch->alarmEnabled = TRUE;
+    armWindowTimer(ctx);
+}
 
-    buf[0] = FLAG;
-    buf[1] = address;
-    buf[2] = control;
-    buf[3] = buf[1] ^ buf[2];
-    buf[4] = FLAG;
+void stopChannelAlarm(LinkLayerCtx *ctx, LinkChannel *ch)
+{
+    ch->alarmEnabled = FALSE;
+    armWindowTimer(ctx);
+}
 
-    int bytes = writeBytesSerialPort(buf, CTRL_BUF_SIZE); // cntrl_buffer
-    if (bytes < 0)
+// The timer fired for the windows. The channels whose deadline passed timed
+// out; otherwise the line is ready for the next queued I-frame.
+void expireWindowTimers(LinkLayerCtx *ctx)
+{
+    long now = nowMicros();
+    int expired = FALSE;
+    for (int i = 0; i < ctx->agreed.channels; i++)
     {
-        printf("Error opening bytes\n");
-        exit(-1);
+        LinkChannel *ch = &ctx->channels[i];
+        if (!ch->alarmEnabled || ch->deadline > now)
+            continue;
+        ch->alarmEnabled = FALSE;
+        ch->alarmCount++;
+        ctx->stats.timeouts++;
+        expired = TRUE;
+        if (ctx->agreed.channels > 1)
+            printf("Alarm #%d on channel %d\n", ch->alarmCount, ch->id);
+        else
+            printf("Alarm #%d\n", ch->alarmCount);
     }
+    if (expired)
+        backoffRtt(ctx);
+    armWindowTimer(ctx);
 }
 
-unsigned char *byteStuffing(const unsigned char *frame, int frameSize, int *stuffedSize)
+// Called when the timer fires.
+// Returns FALSE if only a telemetry snapshot was due.
+int alarmHandler(LinkLayerCtx *ctx)
 {
-
-    // Allocate memory for the worst case possible
-    unsigned char *stuffedData = (unsigned char *)malloc(2 * frameSize - 2);
-    if (stuffedData == NULL)
+    uint64_t expirations;
+    if (read(ctx->timerFd, &expirations, sizeof(expirations)) < 0)
+        perror("timerfd");
+    long now = nowMicros();
+    if (ctx->nextMetricsAt != 0 && now >= ctx->nextMetricsAt)
+        reportMetrics(ctx, FALSE);
+    // Only the snapshot was due
+    if (ctx->alarmDeadline == 0 || now < ctx->alarmDeadline)
     {
-        printf("Memory allocation failed\n");
-        *stuffedSize = -1;
-        exit(-1);
+        armTimer(ctx);
+        return FALSE;
     }
-
-    int j = 0; // Index for stuf
-
-    // First 4 bytes shouldn't be stuffed (FLAG, ADDRESS, CONTROL, BCC)
-    stuffedData[j++] = frame[0];
-    stuffedData[j++] = frame[1];
-    stuffedData[j++] = frame[2];
-    stuffedData[j++] = frame[3];
-
-    // Apply byte stuffing to the data section
-    for (int i = 4; i < frameSize - 2; i++)
+    ctx->alarmEnabled = FALSE;
+    ctx->alarmDeadline = 0;
+    if (ctx->windowTimer)
     {
-        if (frame[i] == FLAG)
-        {
-            stuffedData[j++] = ESC;
-            stuffedData[j++] = 0x5E;
-        }
-        else if (frame[i] == ESC)
-        {
-            stuffedData[j++] = ESC;
-            stuffedData[j++] = 0x5D;
-        }
-        else
-            stuffedData[j++] = frame[i];
+        expireWindowTimers(ctx);
+        return TRUE;
     }
-
-    // Last 2 bytes shouldn't be stuffed (BCC2, FLAG)
-    stuffedData[j++] = frame[frameSize - 2];
-    stuffedData[j++] = frame[frameSize - 1];
-    *stuffedSize = j; // Update the size of the stuffed data
-    return stuffedData;
+    ctx->alarmCount++;
+    ctx->stats.timeouts++;
+    backoffRtt(ctx);
+    printf("Alarm #%d\n", ctx->alarmCount);
+    return TRUE;
 }
 
-unsigned char *createIFrame(const unsigned char *buf, int bufSize, int *stuffedSize)
+// returns 1 if BCC2 is correct
+int checkBCC2(unsigned char message[], int charsRead, unsigned char bcc2_byte)
 {
-    // Dynamically allocate memory for the frame
-    unsigned char *frame = (unsigned char *)malloc(CTRL_BUF_SIZE + bufSize + 2);
-    if (frame == NULL)
+    unsigned char BCC2 = 0x00;
+    for (int i = 0; i <= charsRead; i++)
+    {
+        BCC2 ^= message[i];
+    }
+    return BCC2 == bcc2_byte;
+}
+
+////////////////////////////////////////////////
+// Frame reception
+////////////////////////////////////////////////
+
+// Drops any partial frame and received bytes not yet deframed
+void resetReceiver(LinkLayerCtx *ctx, unsigned char *body, int capacity, LinkLayerFcs fcsType)
+{
+    deframerInit(&ctx->deframer, body, capacity, fcsType);
+    ctx->rxChunkPosition = 0;
+    ctx->rxChunkSize = 0;
+}
+
+void sendPendingAcks(LinkLayerCtx *ctx);
+
+// Feeds received bytes to the deframer a chunk at a time, blocking on both
+// the serial port and the timer (if armed for a retransmission or a telemetry
+// snapshot). Without wait it only takes the bytes already received.
+// Returns TRUE when a complete frame is ready in deframer, FALSE if the timer
+// expired first or, without wait, the received bytes ran out.
+int receiveFrameWait(LinkLayerCtx *ctx, int wait)
+{
+    if (ctx->deframer.currentState == STOP_STATE)
+        deframerNext(&ctx->deframer);
+
+    while (TRUE)
+    {
+        if (ctx->rxChunkPosition == ctx->rxChunkSize)
+        {
+            // Nothing received is left to handle, so an acknowledgment none
+            // of our I-frames has carried yet goes out on its own
+            sendPendingAcks(ctx);
+
+            int eventFd = ctx->alarmEnabled || ctx->nextMetricsAt != 0 ? ctx->timerFd : -1;
+            int events = wait ? waitSerialPortCtx(&ctx->port, eventFd) : pollSerialPortCtx(&ctx->port, eventFd);
+            if (events < 0)
+            {
+                printf("error\n");
+                exit(-1);
+            }
+            // Bytes that arrived with the timeout may be the acknowledgment
+            // that stops it, so one chunk of them goes first
+            if ((events & SERIAL_EVENT) && (!(events & SERIAL_READABLE) || ctx->alarmDeferred))
+            {
+                ctx->alarmDeferred = FALSE;
+                if (alarmHandler(ctx))
+                    return FALSE;
+                continue;
+            }
+            ctx->alarmDeferred = (events & SERIAL_EVENT) != 0;
+            if (!(events & SERIAL_READABLE))
+                return FALSE;
+
+            int readBytes = readBytesSerialPortCtx(&ctx->port, ctx->rxChunk, RX_CHUNK_SIZE);
+            // A port that hung up stays readable with nothing to read, so
+            // waiting on it again would only spin
+            if (readBytes < 0 || (readBytes == 0 && (events & SERIAL_HANGUP)))
+            {
+                printf("error\n");
+                exit(-1);
+            }
+            if (readBytes == 0)
+                return FALSE;
+            ctx->rxChunkPosition = 0;
+            ctx->rxChunkSize = readBytes;
+            ctx->stats.wireBytesReceived += readBytes;
+        }
+
+        ctx->rxChunkPosition += deframerPush(&ctx->deframer, &ctx->rxChunk[ctx->rxChunkPosition], ctx->rxChunkSize - ctx->rxChunkPosition);
+        if (ctx->deframer.currentState == STOP_STATE)
+        {
+            linkRestored(ctx);
+            return TRUE;
+        }
+    }
+}
+
+int receiveFrame(LinkLayerCtx *ctx)
+{
+    return receiveFrameWait(ctx, TRUE);
+}
+
+// TRUE if the received frame is the supervision frame (address, control)
+int isCtrlFrame(LinkLayerCtx *ctx, unsigned char address, unsigned char control)
+{
+    return ctx->deframer.address == address && ctx->deframer.control == control && ctx->deframer.bodySize == 0 && !ctx->deframer.escPending;
+}
+
+// TRUE if the received frame is a SET/UA (address, control), with or without
+// negotiation parameters. The parameters are left in ctrlParams.
+int isParamFrame(LinkLayerCtx *ctx, unsigned char address, unsigned char control)
+{
+    if (ctx->deframer.address != address || ctx->deframer.control != control || ctx->deframer.escPending)
+        return FALSE;
+
+    int size = ctx->deframer.bodySize;
+    if (size == 0)
+    {
+        ctx->ctrlParamsLength = 0;
+        return TRUE;
+    }
+
+    // Last parameter byte is the BCC2
+    if (ctx->deframer.body != ctx->ctrlParams || size < 2 || !checkBCC2(ctx->ctrlParams, size - 2, ctx->ctrlParams[size - 1]))
+        return FALSE;
+    ctx->ctrlParamsLength = size - 1;
+    return TRUE;
+}
+
+// Channel of the received frame, or NULL if it is not from the other side or
+// its channel was not agreed
+LinkChannel *frameChannel(LinkLayerCtx *ctx)
+{
+    unsigned char address = ctx->deframer.address;
+    if (ADDRESS_SENDER(address) != PEER_ADDRESS(ctx) || ADDRESS_CHANNEL(address) >= ctx->agreed.channels)
+        return NULL;
+    return &ctx->channels[ADDRESS_CHANNEL(address)];
+}
+
+// TRUE if the received frame acknowledges or rejects I-frames
+int isAckFrame(LinkLayerCtx *ctx)
+{
+    unsigned char control = ctx->deframer.control;
+    if (frameChannel(ctx) == NULL || ctx->deframer.bodySize != 0 || ctx->deframer.escPending)
+        return FALSE;
+    if (ctx->agreed.arq == LlStopAndWait)
+        return control == RR0 || control == RR1 || control == REJ0 || control == REJ1;
+    return IS_S_FRAME(control);
+}
+
+// TRUE if the received frame is an I-frame, valid or not
+int isInfoFrame(LinkLayerCtx *ctx)
+{
+    if (frameChannel(ctx) == NULL)
+        return FALSE;
+    if (ctx->agreed.arq == LlStopAndWait)
+        return ctx->deframer.control == C0 || ctx->deframer.control == C1;
+    return IS_I_FRAME(ctx->deframer.control);
+}
+
+void buildCtrlWord(LinkLayerCtx *ctx, unsigned char address, unsigned char control)
+{
+
+    unsigned char buf[CTRL_BUF_SIZE] = {0};
+
+    buf[0] = FLAG;
+    buf[1] = address;
+    buf[2] = control;
+    buf[3] = buf[1] ^ buf[2];
+    buf[4] = FLAG;
+
+    int bytes = writeBytesSerialPortCtx(&ctx->port, buf, CTRL_BUF_SIZE); // cntrl_buffer
+    if (bytes < 0)
+    {
+        printf("Error opening bytes\n");
+        exit(-1);
+    }
+    ctx->stats.wireBytesSent += bytes;
+}
+
+// Supervision frame carrying negotiation parameters
+// (FLAG | ADDRESS | CONTROL | BCC1 | PARAMS | BCC2 | FLAG)
+void buildParamCtrlWord(LinkLayerCtx *ctx, unsigned char address, unsigned char control, const unsigned char *params, int paramsSize)
+{
+    unsigned char buf[CTRL_BUF_SIZE + 2 * (MAX_PARAMS_SIZE + 1)];
+    int j = 0;
+
+    buf[j++] = FLAG;
+    buf[j++] = address;
+    buf[j++] = control;
+    buf[j++] = address ^ control;
+
+    unsigned int BCC2 = fcsInit(LlFcsXor);
+    j += stuffBytes(params, paramsSize, &buf[j], LlFcsXor, &BCC2);
+    unsigned char bcc2Byte = BCC2;
+    j += stuffBytes(&bcc2Byte, 1, &buf[j], LlFcsXor, NULL);
+    buf[j++] = FLAG;
+
+    int bytes = writeBytesSerialPortCtx(&ctx->port, buf, j);
+    if (bytes < 0)
+    {
+        printf("Error opening bytes\n");
+        exit(-1);
+    }
+    ctx->stats.wireBytesSent += bytes;
+}
+
+// Encodes the options as SET/UA parameters, returns the parameters size
+int encodeParams(LinkLayerOptions o, unsigned char *params)
+{
+    int n = 0;
+    params[n++] = PARAM_ARQ;
+    params[n++] = 1;
+    params[n++] = o.arq;
+    params[n++] = PARAM_WINDOW;
+    params[n++] = 1;
+    params[n++] = o.windowSize;
+    params[n++] = PARAM_FCS;
+    params[n++] = 1;
+    params[n++] = o.fcs;
+    params[n++] = PARAM_PAYLOAD;
+    params[n++] = 2;
+    params[n++] = o.maxPayloadSize >> 8;
+    params[n++] = o.maxPayloadSize & 0xFF;
+    params[n++] = PARAM_FEC;
+    params[n++] = 1;
+    params[n++] = o.fecParity;
+    if (o.duplex)
+    {
+        params[n++] = PARAM_DUPLEX;
+        params[n++] = 1;
+        params[n++] = 1;
+    }
+    if (o.channels > 1)
+    {
+        params[n++] = PARAM_CHANNELS;
+        params[n++] = 1;
+        params[n++] = o.channels;
+    }
+    if (o.resumeFingerprint != 0)
+    {
+        params[n++] = PARAM_RESUME;
+        params[n++] = 8;
+        for (int shift = 24; shift >= 0; shift -= 8)
+            params[n++] = (o.resumeFingerprint >> shift) & 0xFF;
+        for (int shift = 24; shift >= 0; shift -= 8)
+            params[n++] = (o.resumeOffset >> shift) & 0xFF;
+    }
+    return n;
+}
+
+// Decodes SET/UA parameters, unknown parameters are skipped
+LinkLayerOptions decodeParams(const unsigned char *params, int paramsSize)
+{
+    LinkLayerOptions o = BASE_OPTIONS;
+    int i = 0;
+    while (i + 2 <= paramsSize && i + 2 + params[i + 1] <= paramsSize)
+    {
+        unsigned char type = params[i];
+        unsigned char length = params[i + 1];
+        const unsigned char *value = &params[i + 2];
+        if (type == PARAM_ARQ && length == 1 && value[0] <= LlSelectiveRepeat)
+            o.arq = value[0];
+        else if (type == PARAM_WINDOW && length == 1)
+            o.windowSize = value[0];
+        else if (type == PARAM_FCS && length == 1 && value[0] <= LlFcsCrc32c)
+            o.fcs = value[0];
+        else if (type == PARAM_PAYLOAD && length == 2)
+            o.maxPayloadSize = (value[0] << 8) | value[1];
+        else if (type == PARAM_FEC && length == 1 && value[0] <= MAX_FEC_PARITY)
+            o.fecParity = value[0];
+        else if (type == PARAM_DUPLEX && length == 1)
+            o.duplex = value[0] != 0;
+        else if (type == PARAM_CHANNELS && length == 1 && value[0] <= LL_MAX_CHANNELS)
+            o.channels = value[0];
+        else if (type == PARAM_RESUME && length == 8)
+        {
+            // Widened before shifting, a byte would be promoted to int
+            o.resumeFingerprint = (unsigned int)value[0] << 24 | (unsigned int)value[1] << 16 | (unsigned int)value[2] << 8 | value[3];
+            unsigned int offset = (unsigned int)value[4] << 24 | (unsigned int)value[5] << 16 | (unsigned int)value[6] << 8 | value[7];
+            // An offset no file of ours reaches means starting over
+            o.resumeOffset = offset <= INT_MAX ? (int)offset : 0;
+        }
+        i += 2 + length;
+    }
+    if (o.channels < 1)
+        o.channels = 1;
+    if (o.windowSize < 1 || o.windowSize > MAX_WINDOW_SIZE)
+        o.windowSize = MAX_WINDOW_SIZE;
+    if (o.arq == LlSelectiveRepeat && o.windowSize > MAX_SELECTIVE_WINDOW_SIZE)
+        o.windowSize = MAX_SELECTIVE_WINDOW_SIZE;
+    if (o.arq == LlStopAndWait)
+        o.windowSize = 1;
+    if (o.maxPayloadSize < 1)
+        o.maxPayloadSize = MAX_PAYLOAD_SIZE;
+    if (o.resumeOffset < 0)
+        o.resumeOffset = 0;
+    return o;
+}
+
+// TRUE if the options are those of the base protocol, so SET carries no
+// parameters
+int isBaseProtocol(LinkLayerOptions o)
+{
+    return o.arq == LlStopAndWait && o.fcs == LlFcsXor && o.maxPayloadSize == MAX_PAYLOAD_SIZE && o.fecParity == 0 && !o.duplex && o.channels <= 1 &&
+           o.resumeFingerprint == 0;
+}
+
+// Writes the stuffed body of an I-frame, adding Reed-Solomon parity after
+// every block of data when FEC is agreed
+typedef struct
+{
+    unsigned char *out;
+    int blockFill; // Data bytes in the current block
+    unsigned char parity[MAX_FEC_PARITY];
+} BodyWriter;
+
+void writeBodyParity(LinkLayerCtx *ctx, BodyWriter *w)
+{
+    w->out += stuffBytes(w->parity, ctx->agreed.fecParity, w->out, ctx->agreed.fcs, NULL);
+    ctx->stats.fecParityBytes += ctx->agreed.fecParity;
+    memset(w->parity, 0, ctx->agreed.fecParity);
+    w->blockFill = 0;
+}
+
+void writeBody(LinkLayerCtx *ctx, BodyWriter *w, const unsigned char *data, int size, unsigned int *fcs)
+{
+    if (ctx->agreed.fecParity == 0)
+    {
+        w->out += stuffBytes(data, size, w->out, ctx->agreed.fcs, fcs);
+        return;
+    }
+
+    int blockData = FEC_BLOCK_SIZE - ctx->agreed.fecParity;
+    while (size > 0)
+    {
+        int n = size < blockData - w->blockFill ? size : blockData - w->blockFill;
+        w->out += stuffBytes(data, n, w->out, ctx->agreed.fcs, fcs);
+        rsEncodeUpdate(w->parity, ctx->agreed.fecParity, data, n);
+        ctx->stats.fecDataBytes += n;
+        w->blockFill += n;
+        data += n;
+        size -= n;
+        if (w->blockFill == blockData)
+            writeBodyParity(ctx, w);
+    }
+}
+
+// Total number of bytes in an I/O vector
+int iovecSize(const struct iovec *iov, int iovcnt)
+{
+    int size = 0;
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    return size;
+}
+
+// Builds a stuffed I-frame into frame (at least STUFFED_FRAME_SIZE of the
+// payload size), stuffing the payload straight from the caller's buffers.
+// Returns the frame size.
+int createIFrame(LinkLayerCtx *ctx, const struct iovec *iov, int iovcnt, unsigned char address, unsigned char control, unsigned char *frame)
+{
+    // FLAG | ADDRESS | CONTROL | BCC1 | DATA | FCS | FLAG, with DATA and FCS
+    // stuffed (and split in blocks followed by their parity with FEC)
+    frame[0] = FLAG;
+    frame[1] = address;
+    frame[2] = control; // Sequence number (Ns)
+    frame[3] = frame[1] ^ frame[2];
+
+    BodyWriter w = {&frame[4], 0, {0}};
+    unsigned int fcs = fcsInit(ctx->agreed.fcs);
+    for (int i = 0; i < iovcnt; i++)
+        writeBody(ctx, &w, iov[i].iov_base, iov[i].iov_len, &fcs);
+
+    unsigned char check[MAX_FCS_SIZE];
+    fcsFinal(ctx->agreed.fcs, fcs, check);
+    writeBody(ctx, &w, check, fcsSize(ctx->agreed.fcs), NULL);
+    if (w.blockFill > 0)
+        writeBodyParity(ctx, &w);
+
+    *w.out++ = FLAG;
+
+    int payloadSize = iovecSize(iov, iovcnt);
+    ctx->stats.iFramesBuilt++;
+    ctx->stats.frameBytes += 5 + FEC_ENCODED_SIZE(payloadSize + fcsSize(ctx->agreed.fcs), ctx->agreed.fecParity);
+    ctx->stats.stuffedFrameBytes += w.out - frame;
+    return w.out - frame;
+}
+
+////////////////////////////////////////////////
+// Frame buffers
+////////////////////////////////////////////////
+
+// Every frame buffer is allocated once when the link opens, so sending and
+// receiving I-frames does no heap allocation. Building with -DLL_NO_HEAP
+// reserves them in the link itself for MAX_PAYLOAD_SIZE and the link layer
+// never uses the heap.
+
+void freeFrameBuffers(LinkLayerCtx *ctx)
+{
+#ifndef LL_NO_HEAP
+    free(ctx->rxMessage);
+    for (int c = 0; c < LL_MAX_CHANNELS; c++)
+    {
+        for (int i = 0; i < SEQ_MODULUS; i++)
+        {
+            free(ctx->channels[c].window[i].frame);
+            free(ctx->channels[c].reorder[i].data);
+        }
+    }
+#endif
+    ctx->rxMessage = NULL;
+    for (int c = 0; c < LL_MAX_CHANNELS; c++)
+    {
+        for (int i = 0; i < SEQ_MODULUS; i++)
+        {
+            ctx->channels[c].window[i].frame = NULL;
+            ctx->channels[c].reorder[i].data = NULL;
+        }
+    }
+}
+
+// Sets up the buffers for I-frames of up to payloadSize bytes, for every
+// agreed channel.
+// Returns -1 on error.
+int allocFrameBuffers(LinkLayerCtx *ctx, int payloadSize)
+{
+    freeFrameBuffers(ctx);
+    ctx->maxPayloadSize = payloadSize;
+
+#ifdef LL_NO_HEAP
+    if (payloadSize > MAX_PAYLOAD_SIZE || ctx->agreed.channels > 1)
+        return -1;
+    ctx->rxMessage = ctx->rxMessageStorage;
+    for (int i = 0; i < SEQ_MODULUS; i++)
+    {
+        ctx->channels[0].window[i].frame = ctx->windowStorage[i];
+        ctx->channels[0].reorder[i].data = ctx->reorderStorage[i];
+    }
+#else
+    ctx->rxMessage = (unsigned char *)malloc(BODY_SIZE(payloadSize, ctx->agreed.fecParity));
+    if (ctx->rxMessage == NULL)
     {
         printf("Memory allocation failed\n");
-        return NULL; // Return error if memory allocation fails
+        return -1;
+    }
+    for (int c = 0; c < ctx->agreed.channels; c++)
+    {
+        for (int i = 0; i < SEQ_MODULUS; i++)
+        {
+            ctx->channels[c].window[i].frame = (unsigned char *)malloc(STUFFED_FRAME_SIZE(BODY_SIZE(payloadSize, ctx->agreed.fecParity)));
+            ctx->channels[c].reorder[i].data = (unsigned char *)malloc(payloadSize + MAX_FCS_SIZE);
+            if (ctx->channels[c].window[i].frame == NULL || ctx->channels[c].reorder[i].data == NULL)
+            {
+                printf("Memory allocation failed\n");
+                return -1;
+            }
+        }
+    }
+#endif
+    return 1;
+}
+
+// Options within the limits the link supports
+LinkLayerOptions clampOptions(LinkLayerOptions options)
+{
+    if (options.channels < 1 || options.channels > LL_MAX_CHANNELS)
+        options.channels = 1;
+    // Acknowledgments ride on I-frames as N(R), and channels each keep their
+    // own sequence numbers, which only the window has
+    if ((options.duplex || options.channels > 1) && options.arq == LlStopAndWait)
+    {
+        options.arq = LlGoBackN;
+        options.windowSize = 1;
+    }
+    if (options.windowSize < 1 || options.windowSize > MAX_WINDOW_SIZE)
+        options.windowSize = MAX_WINDOW_SIZE;
+    if (options.arq == LlSelectiveRepeat && options.windowSize > MAX_SELECTIVE_WINDOW_SIZE)
+        options.windowSize = MAX_SELECTIVE_WINDOW_SIZE;
+    if (options.arq == LlStopAndWait)
+        options.windowSize = 1;
+    if (options.maxPayloadSize < MAX_PAYLOAD_SIZE)
+        options.maxPayloadSize = MAX_PAYLOAD_SIZE;
+    if (options.maxPayloadSize > MAX_NEGOTIATED_PAYLOAD_SIZE)
+        options.maxPayloadSize = MAX_NEGOTIATED_PAYLOAD_SIZE;
+    if (options.fecParity < 0 || options.fecParity > MAX_FEC_PARITY)
+        options.fecParity = 0;
+    if (options.resumeOffset < 0)
+        options.resumeOffset = 0;
+    if (options.metricsIntervalMicros < 0)
+        options.metricsIntervalMicros = 0;
+#ifdef LL_NO_HEAP
+    // Static buffers only hold MAX_PAYLOAD_SIZE, for one channel, and the
+    // link thread's rings would need the heap
+    options.maxPayloadSize = MAX_PAYLOAD_SIZE;
+    options.channels = 1;
+    options.ioThread = FALSE;
+#endif
+    return options;
+}
+
+int ll_maxpayload_ctx(LinkLayerCtx *ctx)
+{
+    return ctx->maxPayloadSize;
+}
+
+int ll_preferredpayload_ctx(LinkLayerCtx *ctx)
+{
+    return ctx->options.adaptivePayload ? ctx->payloadTarget : ctx->maxPayloadSize;
+}
+
+int ll_duplex_ctx(LinkLayerCtx *ctx)
+{
+    return ctx->agreed.duplex;
+}
+
+int ll_channels_ctx(LinkLayerCtx *ctx)
+{
+    return ctx->agreed.channels;
+}
+
+int ll_resume_offset_ctx(LinkLayerCtx *ctx)
+{
+    return ctx->agreed.resumeOffset;
+}
+
+void printAgreedOptions(LinkLayerCtx *ctx)
+{
+    const char *fcsNames[] = {"XOR BCC2", "CRC-16", "CRC-32C"};
+    printf("Frame check: %s\n", fcsNames[ctx->agreed.fcs]);
+    if (ctx->agreed.arq == LlGoBackN)
+        printf("Go-Back-N ARQ, window of %d frames\n", ctx->agreed.windowSize);
+    else if (ctx->agreed.arq == LlSelectiveRepeat)
+        printf("Selective Repeat ARQ, window of %d frames\n", ctx->agreed.windowSize);
+    else
+        printf("Stop-and-wait ARQ\n");
+    printf("Maximum frame payload: %d bytes\n", ctx->agreed.maxPayloadSize);
+    if (ctx->agreed.fecParity > 0)
+        printf("Forward error correction: RS(%d,%d)\n", FEC_BLOCK_SIZE, FEC_BLOCK_SIZE - ctx->agreed.fecParity);
+    if (ctx->agreed.duplex)
+        printf("Full duplex, acknowledgments piggybacked on I-frames\n");
+    if (ctx->agreed.channels > 1)
+        printf("Logical channels: %d\n", ctx->agreed.channels);
+    if (ctx->agreed.resumeOffset > 0)
+        printf("Resuming the transfer at byte %d\n", ctx->agreed.resumeOffset);
+}
+
+////////////////////////////////////////////////
+// Sliding window (Go-Back-N / Selective Repeat)
+////////////////////////////////////////////////
+
+// Every channel runs its own window. A new I-frame waits in it until
+// transmitQueued gives it to the line. Selective Repeat writes its
+// retransmissions at once; Go-Back-N puts the frames back in the queue.
+
+void resetWindow(LinkLayerCtx *ctx)
+{
+    for (int c = 0; c < LL_MAX_CHANNELS; c++)
+    {
+        LinkChannel *ch = &ctx->channels[c];
+        ch->id = c;
+        ch->sequenceNumber = 0;
+        for (int i = 0; i < SEQ_MODULUS; i++)
+        {
+            ch->window[i].size = 0;
+            ch->reorder[i].received = FALSE;
+            ch->reorder[i].srejSent = FALSE;
+            ch->reorder[i].dropped = FALSE;
+        }
+        ch->windowBase = 0;
+        ch->nextSeq = 0;
+        ch->outstanding = 0;
+        ch->sent = 0;
+        ch->rejSent = FALSE;
+        ch->ackPending = FALSE;
+        ch->rxDropped = FALSE;
+        ch->alarmEnabled = FALSE;
+        ch->alarmCount = 0;
+        ch->writesFirst = 0;
+        ch->writesCount = 0;
+        ch->writesFramed = 0;
+        ch->writesAcked = 0;
+        ch->readsFirst = 0;
+        ch->readsCount = 0;
+    }
+    ctx->lineFreeAt = 0;
+    ctx->sendTurn = 0;
+    ctx->readTurn = 0;
+    ctx->discReceived = FALSE;
+}
+
+// I-frames of all channels not yet acknowledged
+int windowsOutstanding(LinkLayerCtx *ctx)
+{
+    int outstanding = 0;
+    for (int i = 0; i < ctx->agreed.channels; i++)
+        outstanding += ctx->channels[i].outstanding;
+    return outstanding;
+}
+
+int selectiveAckPoint(LinkChannel *ch);
+
+int sendWindowFrame(LinkLayerCtx *ctx, LinkChannel *ch, int seq)
+{
+    WindowSlot *slot = &ch->window[seq];
+    if (ctx->agreed.duplex)
+    {
+        // Every transmission carries the latest acknowledgment. The header is
+        // never stuffed, so it is updated in place.
+        slot->frame[2] = I_FRAME_NR(seq, selectiveAckPoint(ch));
+        slot->frame[3] = slot->frame[1] ^ slot->frame[2];
+        if (ch->ackPending)
+            ctx->stats.piggybackedAcks++;
+        ch->ackPending = FALSE;
+    }
+
+    int bytes = writeBytesSerialPortCtx(&ctx->port, slot->frame, slot->size);
+    if (bytes < 0)
+    {
+        printf("error\n");
+        exit(-1);
+    }
+    ctx->stats.wireBytesSent += bytes;
+    long now = nowMicros();
+    ctx->lineFreeAt = (ctx->lineFreeAt > now ? ctx->lineFreeAt : now) + lineMicros(ctx, slot->size);
+    ctx->stats.framesSent++;
+    return bytes;
+}
+
+// Next channel with an I-frame waiting for the line. The channels take turns,
+// one frame each.
+LinkChannel *nextToTransmit(LinkLayerCtx *ctx)
+{
+    for (int i = 0; i < ctx->agreed.channels; i++)
+    {
+        LinkChannel *ch = &ctx->channels[(ctx->sendTurn + i) % ctx->agreed.channels];
+        if (ch->outstanding > ch->sent)
+        {
+            ctx->sendTurn = (ch->id + 1) % ctx->agreed.channels;
+            return ch;
+        }
+    }
+    return NULL;
+}
+
+// Gives the I-frames waiting in the windows to the line. With several
+// channels the line is paced (see LINE_LEAD_MICROS), so the frames wait here,
+// where the channels still take turns, rather than in the serial port.
+void transmitQueued(LinkLayerCtx *ctx)
+{
+    int started[LL_MAX_CHANNELS] = {FALSE};
+    while (ctx->agreed.channels == 1 || ctx->lineFreeAt - nowMicros() <= LINE_LEAD_MICROS)
+    {
+        LinkChannel *ch = nextToTransmit(ctx);
+        if (ch == NULL)
+            break;
+
+        int seq = (ch->windowBase + ch->sent) % SEQ_MODULUS;
+        WindowSlot *slot = &ch->window[seq];
+        if (ch->sent == 0)
+            started[ch->id] = TRUE;
+        if (slot->retransmitted)
+            ctx->stats.framesRetransmitted++;
+        else
+            slot->sentAt = nowMicros();
+        sendWindowFrame(ctx, ch, seq);
+        ch->sent++;
+
+        if (slot->retransmitted)
+            continue;
+        ctx->stats.channelFramesSent[ch->id]++;
+        if (ctx->agreed.channels > 1)
+            printf("Sent I Frame %d on channel %d\n", seq, ch->id);
+        else
+            printf("Sent I Frame %d\n", seq);
+    }
+
+    // Timers start once the frames are out, allowing for their time on the line
+    for (int i = 0; i < ctx->agreed.channels; i++)
+    {
+        if (started[i])
+            startChannelAlarm(ctx, &ctx->channels[i]);
+    }
+    if (ctx->agreed.channels > 1)
+        armWindowTimer(ctx);
+}
+
+// Go-Back-N: the frames given to the line are queued again, in order
+void goBack(LinkLayerCtx *ctx, LinkChannel *ch)
+{
+    // One failure, the rest of the window only went back with it
+    recordFrameOutcome(ctx, ch->window[ch->windowBase].size, TRUE);
+    for (int i = 0; i < ch->sent; i++)
+        ch->window[(ch->windowBase + i) % SEQ_MODULUS].retransmitted = TRUE;
+    ch->sent = 0;
+    stopChannelAlarm(ctx, ch);
+    transmitQueued(ctx);
+}
+
+// Selective Repeat: resends one frame already given to the line
+void resendFrame(LinkLayerCtx *ctx, LinkChannel *ch, int seq)
+{
+    sendWindowFrame(ctx, ch, seq);
+    ch->window[seq].retransmitted = TRUE;
+    recordFrameOutcome(ctx, ch->window[seq].size, TRUE);
+}
+
+// Cumulative acknowledgment of every frame of the channel before nr.
+// Returns the number of frames released, or -1 if nr is outside the window.
+int acknowledgeUpTo(LinkLayerCtx *ctx, LinkChannel *ch, int nr)
+{
+    int acked = (nr - ch->windowBase + SEQ_MODULUS) % SEQ_MODULUS;
+    if (acked > ch->outstanding)
+        return -1;
+
+    if (acked > 0)
+    {
+        // The newest frame acknowledged gives the round-trip sample
+        WindowSlot *last = &ch->window[(nr + SEQ_MODULUS - 1) % SEQ_MODULUS];
+        if (acked <= ch->sent && !last->retransmitted)
+            sampleRtt(ctx, nowMicros() - last->sentAt);
+
+        long now = nowMicros();
+        for (int i = 0; i < acked; i++)
+        {
+            WindowSlot *slot = &ch->window[(ch->windowBase + i) % SEQ_MODULUS];
+            recordFrameOutcome(ctx, slot->size, FALSE);
+            histogramAdd(&ctx->stats.ackLatency, now - slot->sentAt);
+            ctx->stats.payloadBytesAcked += slot->payloadSize;
+            if (slot->async)
+                ch->writesAcked++;
+        }
+    }
+
+    ch->windowBase = nr;
+    ch->outstanding -= acked;
+    // Frames queued again by Go-Back-N may be acknowledged by their first copy
+    ch->sent = acked < ch->sent ? ch->sent - acked : 0;
+
+    if (acked > 0)
+    {
+        // Progress restarts the retransmission count and the timer
+        ch->alarmCount = 0;
+        if (ch->sent > 0)
+        {
+            startChannelAlarm(ctx, ch);
+        }
+        else
+        {
+            stopChannelAlarm(ctx, ch);
+        }
+    }
+    return acked;
+}
+
+// Resends the channel's frames once its timer expired
+void retransmitOnTimeout(LinkLayerCtx *ctx, LinkChannel *ch)
+{
+    if (ch->sent == 0 || ch->alarmEnabled)
+        return;
+    if (ch->alarmCount >= ctx->cp.nRetransmissions)
+        linkDown(ctx);
+    if (ctx->agreed.arq == LlSelectiveRepeat)
+    {
+        // Later frames are probably buffered by the receiver
+        printf("Timeout. Retransmiting frame %d\n", ch->windowBase);
+        resendFrame(ctx, ch, ch->windowBase);
+        ctx->stats.framesRetransmitted++;
+        startChannelAlarm(ctx, ch);
+    }
+    else
+    {
+        printf("Timeout. Going back to frame %d\n", ch->windowBase);
+        goBack(ctx, ch);
+    }
+}
+
+// Handles the RR, REJ or SREJ in the received frame
+void handleAckFrame(LinkLayerCtx *ctx)
+{
+    LinkChannel *ch = frameChannel(ctx);
+    unsigned char control = ctx->deframer.control;
+    int nr = FRAME_NR(control);
+    if (S_FRAME_TYPE(control) == RR_N(0))
+    {
+        acknowledgeUpTo(ctx, ch, nr);
+    }
+    else if (S_FRAME_TYPE(control) == REJ_N(0) && acknowledgeUpTo(ctx, ch, nr) >= 0 && ch->sent > 0)
+    {
+        printf("Frame %d rejected. Going back...\n", nr);
+        ctx->stats.rejectsReceived++;
+        goBack(ctx, ch);
+    }
+    else if (S_FRAME_TYPE(control) == SREJ_N(0) && (nr - ch->windowBase + SEQ_MODULUS) % SEQ_MODULUS < ch->sent)
+    {
+        // Only the damaged frame is resent, the timer keeps running
+        printf("Frame %d selectively rejected. Retransmiting...\n", nr);
+        resendFrame(ctx, ch, nr);
+        ctx->stats.rejectsReceived++;
+        ctx->stats.framesSelectiveRetransmitted++;
+    }
+}
+
+int queuesReceived(LinkLayerCtx *ctx);
+void handleQueuedFrame(LinkLayerCtx *ctx);
+
+// Handles expired timers, gives queued I-frames to the line and handles the
+// next received frame. On a duplex link or with several channels the other
+// side's I-frames are taken in as well.
+void serviceWindow(LinkLayerCtx *ctx)
+{
+    for (int i = 0; i < ctx->agreed.channels; i++)
+        retransmitOnTimeout(ctx, &ctx->channels[i]);
+    transmitQueued(ctx);
+
+    if (!receiveFrame(ctx))
+        return;
+    if (isAckFrame(ctx))
+        handleAckFrame(ctx);
+    else if (queuesReceived(ctx))
+        handleQueuedFrame(ctx);
+}
+
+// Builds the next I-frame of the channel into its window, where it waits for
+// transmitQueued. The window must have room for it.
+// Returns its window slot.
+WindowSlot *queueWindowFrame(LinkLayerCtx *ctx, LinkChannel *ch, const struct iovec *iov, int iovcnt)
+{
+    WindowSlot *slot = &ch->window[ch->nextSeq];
+    slot->size = createIFrame(ctx, iov, iovcnt, LOCAL_CHANNEL_ADDRESS(ctx, ch), I_FRAME(ch->nextSeq), slot->frame);
+    slot->payloadSize = iovecSize(iov, iovcnt);
+    slot->retransmitted = FALSE;
+    slot->async = FALSE;
+
+    if (ch->outstanding == 0)
+        ch->alarmCount = 0;
+    ch->outstanding++;
+    ch->nextSeq = (ch->nextSeq + 1) % SEQ_MODULUS;
+    return slot;
+}
+
+int llwriteWindow(LinkLayerCtx *ctx, LinkChannel *ch, const struct iovec *iov, int iovcnt)
+{
+    // Wait for room in the window
+    while (ch->outstanding >= ctx->agreed.windowSize)
+        serviceWindow(ctx);
+
+    if (iovecSize(iov, iovcnt) > ctx->maxPayloadSize)
+        return -1;
+    WindowSlot *slot = queueWindowFrame(ctx, ch, iov, iovcnt);
+    transmitQueued(ctx);
+
+    return slot->size;
+}
+
+// Checks the I-frame just received, its DATA | FCS is left in rxMessage
+// (repaired and without the parity when FEC is agreed).
+// Returns the size of DATA | FCS.
+int checkIFrame(LinkLayerCtx *ctx)
+{
+    int size = ctx->deframer.bodySize;
+    if (ctx->agreed.fecParity > 0)
+    {
+        // Repair the body first, the frame check covers the corrected data
+        int corrected = 0;
+        int dataSize = ctx->deframer.escPending ? -1 : fecDecode(ctx->rxMessage, size, ctx->agreed.fecParity, &corrected);
+        ctx->isValid = dataSize >= fcsSize(ctx->agreed.fcs) &&
+                  fcsCheck(ctx->agreed.fcs, fcsUpdate(ctx->agreed.fcs, fcsInit(ctx->agreed.fcs), ctx->rxMessage, dataSize));
+        if (ctx->isValid)
+        {
+            ctx->stats.fecDataBytes += dataSize;
+            ctx->stats.fecParityBytes += size - dataSize;
+            if (corrected > 0)
+            {
+                ctx->stats.fecRepairedFrames++;
+                ctx->stats.fecCorrectedBytes += corrected;
+            }
+        }
+        size = dataSize < 0 ? 0 : dataSize;
+    }
+    else
+    {
+        ctx->isValid = deframerCheck(&ctx->deframer);
     }
 
-    // Build the frame without stuffing (FLAG | ADDRESS | CONTROL | BCC1 | DATA | BCC2 | FLAG)
-    frame[0] = FLAG;
-    frame[1] = ADDRESS_TX;
-    frame[2] = sequenceNumber ? 0x80 : 0x00; // Sequence number (Ns = 0 or 1)
-    frame[3] = frame[1] ^ frame[2];
+    ctx->isRepeated = (ctx->deframer.control == ctx->sequenceChar);
+    ctx->stats.framesReceived++;
+    return size;
+}
+
+// Waits for a complete I-frame and checks it (see checkIFrame).
+// Returns the size of DATA | FCS.
+int receiveIFrame(LinkLayerCtx *ctx)
+{
+    while (!receiveFrame(ctx) || !isInfoFrame(ctx))
+        ;
+    return checkIFrame(ctx);
+}
+
+int llreadWindow(LinkLayerCtx *ctx, unsigned char *packet)
+{
+    LinkChannel *ch = &ctx->channels[0];
+    while (TRUE)
+    {
+        int size = receiveIFrame(ctx) - fcsSize(ctx->agreed.fcs);
+        int ns = FRAME_NS(ctx->deframer.control);
+
+        if (ctx->isValid && ns == ch->sequenceNumber)
+        {
+            memcpy(packet, ctx->rxMessage, size);
+            ch->sequenceNumber = (ch->sequenceNumber + 1) % SEQ_MODULUS;
+            ch->rejSent = FALSE;
+            buildCtrlWord(ctx, LOCAL_ADDRESS(ctx), RR_N(ch->sequenceNumber));
+            printf("Frame %d accepted, RR%d SENT\n", ns, ch->sequenceNumber);
+            ctx->totalPacketsRead++;
+            ctx->bytesRead += size;
+            return size;
+        }
+
+        if (!ctx->isValid || (ns - ch->sequenceNumber + SEQ_MODULUS) % SEQ_MODULUS < ctx->agreed.windowSize)
+        {
+            // Corrupted frame or a gap after a lost one: go back once per gap
+            ctx->stats.errorFrames++;
+            if (!ch->rejSent)
+            {
+                buildCtrlWord(ctx, LOCAL_ADDRESS(ctx), REJ_N(ch->sequenceNumber));
+                printf("REJ%d SENT\n", ch->sequenceNumber);
+                ch->rejSent = TRUE;
+            }
+        }
+        else
+        {
+            // Duplicate of a frame already delivered
+            buildCtrlWord(ctx, LOCAL_ADDRESS(ctx), RR_N(ch->sequenceNumber));
+            printf("REPEATED RR%d SENT\n", ch->sequenceNumber);
+        }
+    }
+}
+
+void sendSelectiveReject(LinkLayerCtx *ctx, LinkChannel *ch, int seq)
+{
+    if (ch->reorder[seq].received || ch->reorder[seq].srejSent)
+        return;
+    buildCtrlWord(ctx, LOCAL_CHANNEL_ADDRESS(ctx, ch), SREJ_N(seq));
+    printf("SREJ%d SENT\n", seq);
+    ch->reorder[seq].srejSent = TRUE;
+    ctx->stats.selectiveRejects++;
+}
+
+// First sequence number not yet received, acknowledged by RR
+int selectiveAckPoint(LinkChannel *ch)
+{
+    int nr = ch->sequenceNumber;
+    while (ch->reorder[nr].received)
+        nr = (nr + 1) % SEQ_MODULUS;
+    return nr;
+}
+
+void resumeDropped(LinkLayerCtx *ctx, LinkChannel *ch);
+
+int deliverReordered(LinkLayerCtx *ctx, LinkChannel *ch, unsigned char *packet)
+{
+    ReorderSlot *slot = &ch->reorder[ch->sequenceNumber];
+    int size = slot->size;
+    memcpy(packet, slot->data, size);
+    slot->received = FALSE;
+    ch->sequenceNumber = (ch->sequenceNumber + 1) % SEQ_MODULUS;
+    ctx->totalPacketsRead++;
+    ctx->bytesRead += size;
+    ctx->stats.channelPacketsRead[ch->id]++;
+    if (ch->rxDropped)
+        resumeDropped(ctx, ch);
+    return size;
+}
+
+int llreadSelective(LinkLayerCtx *ctx, unsigned char *packet)
+{
+    LinkChannel *ch = &ctx->channels[0];
+    // Frames that arrived ahead of a retransmission are delivered first
+    if (ch->reorder[ch->sequenceNumber].received)
+        return deliverReordered(ctx, ch, packet);
+
+    while (TRUE)
+    {
+        int size = receiveIFrame(ctx) - fcsSize(ctx->agreed.fcs);
+
+        // The header passed BCC1, so N(S) is trusted even when the data is damaged
+        int ns = FRAME_NS(ctx->deframer.control);
+        int offset = (ns - ch->sequenceNumber + SEQ_MODULUS) % SEQ_MODULUS;
+
+        if (offset >= ctx->agreed.windowSize)
+        {
+            // Duplicate of a frame already delivered
+            if (ctx->isValid)
+            {
+                buildCtrlWord(ctx, LOCAL_ADDRESS(ctx), RR_N(selectiveAckPoint(ch)));
+                printf("REPEATED RR%d SENT\n", selectiveAckPoint(ch));
+            }
+        }
+        else if (!ctx->isValid)
+        {
+            ctx->stats.errorFrames++;
+            sendSelectiveReject(ctx, ch, ns);
+        }
+        else if (offset == 0)
+        {
+            memcpy(packet, ctx->rxMessage, size);
+            ch->reorder[ns].srejSent = FALSE;
+            ch->sequenceNumber = (ch->sequenceNumber + 1) % SEQ_MODULUS;
+            ctx->totalPacketsRead++;
+            ctx->bytesRead += size;
+
+            int nr = selectiveAckPoint(ch);
+            buildCtrlWord(ctx, LOCAL_ADDRESS(ctx), RR_N(nr));
+            printf("Frame %d accepted, RR%d SENT\n", ns, nr);
+            return size;
+        }
+        else if (!ch->reorder[ns].received)
+        {
+            ReorderSlot *slot = &ch->reorder[ns];
+            memcpy(slot->data, ctx->rxMessage, size);
+            slot->size = size;
+            slot->received = TRUE;
+            slot->srejSent = FALSE;
+
+            // Ask for every missing frame before this one
+            for (int seq = ch->sequenceNumber; seq != ns; seq = (seq + 1) % SEQ_MODULUS)
+                sendSelectiveReject(ctx, ch, seq);
+            printf("Frame %d buffered\n", ns);
+        }
+    }
+}
+
+////////////////////////////////////////////////
+// Queued reception (duplex, logical channels and asynchronous reads)
+////////////////////////////////////////////////
+
+// Both sides run the window code above for their own I-frames. The other
+// side's I-frames may arrive while waiting in llwrite, on a channel other
+// than the one being read, or before an asynchronous read asks for them, so
+// every accepted one waits in its channel's reorder until llread takes it. Its acknowledgment rides on the next I-frame
+// of the channel on a duplex link (see sendWindowFrame), and otherwise goes
+// out once receiveFrame has to wait for more bytes.
+
+// TRUE if received I-frames wait for llread in their channel's reorder
+int queuesReceived(LinkLayerCtx *ctx)
+{
+    return ctx->agreed.duplex || ctx->agreed.channels > 1 || ctx->asyncIo;
+}
+
+void sendPendingAcks(LinkLayerCtx *ctx)
+{
+    for (int i = 0; i < ctx->agreed.channels; i++)
+    {
+        LinkChannel *ch = &ctx->channels[i];
+        if (!ch->ackPending)
+            continue;
+        int nr = selectiveAckPoint(ch);
+        buildCtrlWord(ctx, LOCAL_CHANNEL_ADDRESS(ctx, ch), RR_N(nr));
+        printf("RR%d SENT\n", nr);
+        ch->ackPending = FALSE;
+    }
+}
+
+void storeReordered(LinkLayerCtx *ctx, LinkChannel *ch, int ns, int size)
+{
+    ReorderSlot *slot = &ch->reorder[ns];
+    memcpy(slot->data, ctx->rxMessage, size);
+    slot->size = size;
+    slot->received = TRUE;
+    slot->srejSent = FALSE;
+    slot->dropped = FALSE;
+}
+
+// Takes the received I-frame in, answering it as llreadWindow or
+// llreadSelective would
+void acceptQueuedIFrame(LinkLayerCtx *ctx, LinkChannel *ch, int size)
+{
+    int ns = FRAME_NS(ctx->deframer.control);
+    int nr = selectiveAckPoint(ch);
+    unsigned char address = LOCAL_CHANNEL_ADDRESS(ctx, ch);
 
-    // Copy data to the frame
-    for (int i = 0; i < bufSize; i++)
+    if (ctx->agreed.arq == LlGoBackN)
     {
-        frame[4 + i] = buf[i];
+        int offset = (ns - nr + SEQ_MODULUS) % SEQ_MODULUS;
+        if (ctx->isValid && offset == 0)
+        {
+            // With every other slot waiting for llread, the frame is dropped
+            // unacknowledged and asked for again once there is room
+            if ((nr - ch->sequenceNumber + SEQ_MODULUS) % SEQ_MODULUS == SEQ_MODULUS - 1)
+            {
+                ch->rxDropped = TRUE;
+                return;
+            }
+            storeReordered(ctx, ch, ns, size);
+            ch->rejSent = FALSE;
+            ch->ackPending = TRUE;
+            printf("Frame %d accepted\n", ns);
+        }
+        else if (!ctx->isValid || offset < ctx->agreed.windowSize)
+        {
+            ctx->stats.errorFrames++;
+            if (!ch->rejSent)
+            {
+                buildCtrlWord(ctx, address, REJ_N(nr));
+                printf("REJ%d SENT\n", nr);
+                ch->rejSent = TRUE;
+            }
+        }
+        else
+        {
+            buildCtrlWord(ctx, address, RR_N(nr));
+            printf("REPEATED RR%d SENT\n", nr);
+        }
+        return;
     }
 
-    // Calculate BCC2
-    unsigned char BCC2 = 0;
-    for (int i = 0; i < bufSize; i++)
+    // The receive window starts at the first frame llread has not taken, so
+    // frames not read yet also hold the other side back
+    int offset = (ns - ch->sequenceNumber + SEQ_MODULUS) % SEQ_MODULUS;
+    if (offset >= ctx->agreed.windowSize && (ns - nr + SEQ_MODULUS) % SEQ_MODULUS < ctx->agreed.windowSize)
+    {
+        // In the other side's window, but beyond ours: dropped, and asked for
+        // again once there is room
+        ch->reorder[ns].dropped = TRUE;
+        ch->rxDropped = TRUE;
+    }
+    else if (offset >= ctx->agreed.windowSize)
+    {
+        if (ctx->isValid)
+        {
+            buildCtrlWord(ctx, address, RR_N(nr));
+            printf("REPEATED RR%d SENT\n", nr);
+        }
+    }
+    else if (!ctx->isValid)
+    {
+        ctx->stats.errorFrames++;
+        sendSelectiveReject(ctx, ch, ns);
+    }
+    else if (!ch->reorder[ns].received)
     {
-        BCC2 ^= buf[i];
+        storeReordered(ctx, ch, ns, size);
+        for (int seq = nr; seq != ns; seq = (seq + 1) % SEQ_MODULUS)
+            sendSelectiveReject(ctx, ch, seq);
+        if (ns == nr)
+        {
+            ch->ackPending = TRUE;
+            printf("Frame %d accepted\n", ns);
+        }
+        else
+        {
+            printf("Frame %d buffered\n", ns);
+        }
     }
+}
 
-    frame[4 + bufSize] = BCC2;
-    frame[5 + bufSize] = FLAG;
+// A read made room after frames were dropped for want of it. Rather than wait
+// for the other side's timeout, Go-Back-N rejects from the first one missing
+// and Selective Repeat asks for each dropped frame the window now holds; those
+// still beyond it wait for the next read.
+void resumeDropped(LinkLayerCtx *ctx, LinkChannel *ch)
+{
+    int nr = selectiveAckPoint(ch);
+    unsigned char address = LOCAL_CHANNEL_ADDRESS(ctx, ch);
+    ch->rxDropped = FALSE;
+    if (ctx->agreed.arq == LlGoBackN)
+    {
+        buildCtrlWord(ctx, address, REJ_N(nr));
+        printf("REJ%d SENT\n", nr);
+        ch->rejSent = TRUE;
+        return;
+    }
+    for (int seq = 0; seq < SEQ_MODULUS; seq++)
+    {
+        ReorderSlot *slot = &ch->reorder[seq];
+        if (!slot->dropped)
+            continue;
+        if ((seq - ch->sequenceNumber + SEQ_MODULUS) % SEQ_MODULUS >= ctx->agreed.windowSize)
+        {
+            ch->rxDropped = TRUE;
+            continue;
+        }
+        // The copy sent after an earlier SREJ may be the one dropped
+        slot->dropped = FALSE;
+        slot->srejSent = FALSE;
+        sendSelectiveReject(ctx, ch, seq);
+    }
+}
 
-    // Apply byte stuffing
-    unsigned char *stuffedFrame = byteStuffing(frame, CTRL_BUF_SIZE + bufSize + 2, stuffedSize);
-    if (stuffedFrame == NULL)
+// Handles a received frame that is not an RR, REJ or SREJ
+void handleQueuedFrame(LinkLayerCtx *ctx)
+{
+    if (isInfoFrame(ctx))
     {
-        printf("ERROR: Couldn't perform byte stuffing\n");
-        free(frame);
-        exit(-1);
+        LinkChannel *ch = frameChannel(ctx);
+        int size = checkIFrame(ctx) - fcsSize(ctx->agreed.fcs);
+        // Piggybacked acknowledgment of our own I-frames of the channel
+        if (ctx->isValid && ctx->agreed.duplex)
+            acknowledgeUpTo(ctx, ch, FRAME_NR(ctx->deframer.control));
+        acceptQueuedIFrame(ctx, ch, size);
+    }
+    else if (isCtrlFrame(ctx, PEER_ADDRESS(ctx), DISC))
+    {
+        ctx->discReceived = TRUE;
     }
+}
 
-    free(frame);
-    return stuffedFrame;
+int llreadQueued(LinkLayerCtx *ctx, LinkChannel *ch, unsigned char *packet)
+{
+    while (!ch->reorder[ch->sequenceNumber].received)
+        serviceWindow(ctx);
+    return deliverReordered(ctx, ch, packet);
 }
 
-LinkLayer cp;
+int startIoThread(LinkLayerCtx *ctx);
+int ioThreadWrite(LinkLayerCtx *ctx, const struct iovec *iov, int iovcnt);
+int ioThreadRead(LinkLayerCtx *ctx, unsigned char *packet);
+
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters)
+// Opens the link with the options already in ctx.
+// Returns the serial port descriptor, or -1 on error.
+int openLink(LinkLayerCtx *ctx, LinkLayer connectionParameters)
 {
     // save connectionParameters
-    cp = connectionParameters;
+    ctx->cp = connectionParameters;
+    ctx->agreed = lldefaultoptions();
+    ctx->sequenceChar = C1;
+    ctx->bytesRead = 0;
+    ctx->totalPacketsRead = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->openedAt = nowMicros();
+    ctx->nextMetricsAt = ctx->options.metricsFile != NULL && ctx->options.metricsIntervalMicros > 0 ? ctx->openedAt + ctx->options.metricsIntervalMicros : 0;
+    resetWindow(ctx);
+
+    // The port is only read once poll found bytes there, but a read still
+    // waits for VMIN of them. Without VTIME to end it early, a frame shorter
+    // than VMIN would block it for good, and the timer with it.
+    if (ctx->options.readMinBytes > 0 && ctx->options.readTimeout == 0)
+    {
+        printf("ERROR: A read minimum (VMIN) needs a read timeout (VTIME).\n");
+        return -1;
+    }
 
-    int fd = openSerialPort(connectionParameters.serialPort,
+    int fd = openSerialPortCtx(&ctx->port, connectionParameters.serialPort,
                             connectionParameters.baudRate);
     if (fd < 0)
     {
         printf("Error opening serial port\n");
         exit(-1);
     }
+    if (setReadTimingSerialPortCtx(&ctx->port, ctx->options.readMinBytes, ctx->options.readTimeout) < 0)
+        return -1;
+
+    ctx->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (ctx->timerFd < 0)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+    ctx->retransmissionTimeout = ctx->options.timeoutMicros > 0 ? ctx->options.timeoutMicros : connectionParameters.timeout * 1000000L;
+    ctx->srtt = 0;
+    ctx->rttvar = 0;
+    ctx->outageStart = 0;
+    resetAlarm(ctx);
+
+    // SET/UA parameters are received straight into ctrlParams
+    resetReceiver(ctx, ctx->ctrlParams, MAX_PARAMS_SIZE + 1, LlFcsXor);
+
     if (connectionParameters.role == LlRx)
     {
+        // reads SET
+        while (!receiveFrame(ctx) || !isParamFrame(ctx, ADDRESS_TX, SET))
+            ;
 
-        StateMachine sm;
-        sm.currentState = START_STATE;
+        printf("SET received\n");
+        if (ctx->ctrlParamsLength > 0)
+        {
+            // Accept the proposal up to the local window and buffer limits
+            ctx->agreed = decodeParams(ctx->ctrlParams, ctx->ctrlParamsLength);
+            if (ctx->agreed.windowSize > ctx->options.windowSize && ctx->options.arq != LlStopAndWait)
+                ctx->agreed.windowSize = ctx->options.windowSize;
+            if (ctx->agreed.maxPayloadSize > ctx->options.maxPayloadSize)
+                ctx->agreed.maxPayloadSize = ctx->options.maxPayloadSize;
+            ctx->agreed.duplex = ctx->agreed.duplex && ctx->options.duplex;
+            if (ctx->agreed.channels > ctx->options.channels)
+                ctx->agreed.channels = ctx->options.channels;
+            // Only the file both sides hold is resumed, from the earlier of
+            // the two offsets
+            if (ctx->agreed.resumeFingerprint != ctx->options.resumeFingerprint)
+                ctx->agreed.resumeOffset = 0;
+            else if (ctx->agreed.resumeOffset > ctx->options.resumeOffset)
+                ctx->agreed.resumeOffset = ctx->options.resumeOffset;
+
+            unsigned char params[MAX_PARAMS_SIZE];
+            int paramsSize = encodeParams(ctx->agreed, params);
+            buildParamCtrlWord(ctx, ADDRESS_RX, UA, params, paramsSize);
+        }
+        else
+        {
+            buildCtrlWord(ctx, ADDRESS_RX, UA);
+        }
+        printf("sent UA\n");
+        printAgreedOptions(ctx);
+    }
+    else
+    {
 
-        unsigned char buf[CTRL_BUF_SIZE] = {0};
-        unsigned char curr_byte;
-        int bufferPosition = 0;
+        resetAlarm(ctx);
+        int received = FALSE;
 
-        do
+        while (ctx->alarmCount < connectionParameters.nRetransmissions && !received)
         {
-            int readBytes = readByteSerialPort(&curr_byte);
-            if (readBytes < 0)
-            {
-                printf("error\n");
-                exit(-1);
-            }
-            if (readBytes == 0)
+            if (ctx->alarmEnabled == FALSE)
             {
-                continue;
+                if (isBaseProtocol(ctx->options))
+                {
+                    buildCtrlWord(ctx, ADDRESS_TX, SET);
+                }
+                else
+                {
+                    unsigned char params[MAX_PARAMS_SIZE];
+                    int paramsSize = encodeParams(ctx->options, params);
+                    buildParamCtrlWord(ctx, ADDRESS_TX, SET, params, paramsSize);
+                }
+                printf("sent SET\n");
+
+                startAlarm(ctx);
             }
-            // printf("Read byte: 0x%02X\n", curr_byte);
-        } while (processCtrlByte(&sm, ADDRESS_TX, SET, curr_byte, buf, &bufferPosition) != 0);
 
-        printf("SET received\n");
-        buildCtrlWord(ADDRESS_RX, UA);
-        printf("sent UA\n");
+            received = receiveFrame(ctx) && isParamFrame(ctx, ADDRESS_RX, UA);
+        }
+        if (ctx->alarmCount == connectionParameters.nRetransmissions)
+        {
+            printf("Maximum retransmissions reached. Exiting...\n");
+            return -1;
+        }
+        if (received)
+        {
+            printf("UA received\n");
+            stopAlarm(ctx);
+            // A plain UA means the receiver only knows the base protocol
+            if (ctx->ctrlParamsLength > 0)
+                ctx->agreed = decodeParams(ctx->ctrlParams, ctx->ctrlParamsLength);
+            printAgreedOptions(ctx);
+        }
     }
-    else
+
+    if (allocFrameBuffers(ctx, ctx->agreed.maxPayloadSize) < 0)
+        return -1;
+    deframerInit(&ctx->deframer, ctx->rxMessage, BODY_SIZE(ctx->maxPayloadSize, ctx->agreed.fecParity), ctx->agreed.fcs);
+    ctx->deframer.checkFcs = ctx->agreed.fecParity == 0;
+    resetPayloadAdaptation(ctx);
+    if (ctx->options.ioThread && startIoThread(ctx) < 0)
+        return -1;
+
+    return fd;
+}
+
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+int ll_write_ctx(LinkLayerCtx *ctx, const unsigned char *buf, int bufSize)
+{
+    struct iovec iov = {(void *)buf, bufSize};
+    return ll_writev_ctx(ctx, &iov, 1);
+}
+
+int ll_writev_ctx(LinkLayerCtx *ctx, const struct iovec *iov, int iovcnt)
+{
+    LinkChannel *ch = &ctx->channels[0];
+    if (ctx->ioThread)
+        return ioThreadWrite(ctx, iov, iovcnt);
+    if (ctx->agreed.arq != LlStopAndWait)
+        return llwriteWindow(ctx, ch, iov, iovcnt);
+
+    if (iovecSize(iov, iovcnt) > ctx->maxPayloadSize)
+        return -1;
+    WindowSlot *slot = &ch->window[0];
+    unsigned char *stuffedFrame = slot->frame;
+    int stuffedSize = createIFrame(ctx, iov, iovcnt, LOCAL_ADDRESS(ctx), ch->sequenceNumber ? C1 : C0, stuffedFrame);
+
+    int bytesSent = 0;
+    resetAlarm(ctx);
+
+    // Retransmission logic
+    while (TRUE)
     {
+        if (ctx->alarmCount >= ctx->cp.nRetransmissions)
+            linkDown(ctx);
+
+        if (ctx->alarmEnabled == FALSE)
+        {
+            // Send the frame, only its first transmission is timed
+            slot->retransmitted = bytesSent > 0;
+            if (!slot->retransmitted)
+                slot->sentAt = nowMicros();
+            else
+                recordFrameOutcome(ctx, stuffedSize, TRUE);
+            bytesSent = writeBytesSerialPortCtx(&ctx->port, stuffedFrame, stuffedSize);
+            if (bytesSent > 0)
+                ctx->stats.wireBytesSent += bytesSent;
+            printf("Sent I Frame\n");
+            ctx->stats.framesSent++;
+            // Start timer
+            startAlarm(ctx);
+        }
+
+        // Wait for acknowledgment frame (RR or REJ)
+        if (!receiveFrame(ctx) || !isAckFrame(ctx))
+            continue;
 
-        resetAlarm();
-        (void)signal(SIGALRM, alarmHandler);
+        // Process the acceptance or rejection frame sent back by the receiver
+        unsigned char ack = ctx->deframer.control;
+        // The receiver got a duplicate of the previous frame and acknowledged
+        // it again. Resending now would duplicate this frame in turn, once per
+        // stale acknowledgment, so a lost frame is left to the timer.
+        if ((ack == RR0 && ch->sequenceNumber == 0) || (ack == RR1 && ch->sequenceNumber == 1))
+        {
+            printf("Repeated frame acknowledged.\n");
+            continue;
+        }
+        if ((ack == RR0 && ch->sequenceNumber == 1) || (ack == RR1 && ch->sequenceNumber == 0))
+        {
+            printf("Acknowledged frame.\n");
+            stopAlarm(ctx);
+            if (!slot->retransmitted)
+                sampleRtt(ctx, nowMicros() - slot->sentAt);
+            histogramAdd(&ctx->stats.ackLatency, nowMicros() - slot->sentAt);
+            ctx->stats.payloadBytesAcked += iovecSize(iov, iovcnt);
+            recordFrameOutcome(ctx, stuffedSize, FALSE);
+            ch->sequenceNumber = (ch->sequenceNumber + 1) % 2; // Update Sequence Number
+            break;
+        }
+        if (ack == REJ0 || ack == REJ1)
+        {
+            printf("Frame rejected. Retransmiting...\n");
+            ctx->stats.rejectsReceived++;
+            ctx->stats.framesRetransmitted++;
+            ctx->alarmEnabled = FALSE;
+            continue;
+        }
+    }
+    return bytesSent;
+}
 
-        // SET UP STATE MACHINE AND BUFFER
-        StateMachine sm;
-        sm.currentState = START_STATE;
+int ll_write_channel_ctx(LinkLayerCtx *ctx, int channel, const unsigned char *buf, int bufSize)
+{
+    struct iovec iov = {(void *)buf, bufSize};
+    return ll_writev_channel_ctx(ctx, channel, &iov, 1);
+}
 
-        unsigned char readbuf[CTRL_BUF_SIZE] = {0};
-        unsigned char curr_byte;
-        int bufferPosition = 0;
-        int result = -1;
+int ll_writev_channel_ctx(LinkLayerCtx *ctx, int channel, const struct iovec *iov, int iovcnt)
+{
+    if (channel < 0 || channel >= ctx->agreed.channels)
+        return -1;
+    if (channel == 0)
+        return ll_writev_ctx(ctx, iov, iovcnt);
+    return llwriteWindow(ctx, &ctx->channels[channel], iov, iovcnt);
+}
 
-        while (alarmCount < connectionParameters.nRetransmissions && result < 0)
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+int ll_read_ctx(LinkLayerCtx *ctx, unsigned char *packet)
+{
+    LinkChannel *ch = &ctx->channels[0];
+    if (ctx->ioThread)
+        return ioThreadRead(ctx, packet);
+    if (queuesReceived(ctx))
+        return llreadQueued(ctx, ch, packet);
+    if (ctx->agreed.arq == LlGoBackN)
+        return llreadWindow(ctx, packet);
+    if (ctx->agreed.arq == LlSelectiveRepeat)
+        return llreadSelective(ctx, packet);
+
+    // Only a new, correct frame is handed to the application
+    while (TRUE)
+    {
+        printf("Processing...\n");
+        int payloadSize = receiveIFrame(ctx) - fcsSize(ctx->agreed.fcs);
+        if (payloadSize < 0)
+            payloadSize = 0;
+        printf("Number of bytes read: %d\n", payloadSize);
+
+        // Send RR|REJ
+        if (ctx->isValid && ctx->isRepeated)
         {
-            if (alarmEnabled == FALSE)
-            {
+            ch->sequenceNumber == 0 ? buildCtrlWord(ctx, ADDRESS_RX, RR0) : buildCtrlWord(ctx, ADDRESS_RX, RR1);
+            printf("REPEATED RR SENT\n");
+            ctx->stats.errorFrames++;
+        }
+        if (ctx->isValid && !ctx->isRepeated)
+        {
+            ch->sequenceNumber == 1 ? buildCtrlWord(ctx, ADDRESS_RX, RR0) : buildCtrlWord(ctx, ADDRESS_RX, RR1);
 
-                buildCtrlWord(ADDRESS_TX, SET);
-                printf("sent SET\n");
+            // change sequenceNumber
+            ch->sequenceNumber = (ch->sequenceNumber + 1) % 2;
+            ctx->sequenceChar = (ctx->sequenceChar == C0) ? C1 : C0;
 
-                alarm(connectionParameters.timeout);
-                alarmEnabled = TRUE;
-            }
+            memcpy(packet, ctx->rxMessage, payloadSize);
+            ctx->totalPacketsRead++;
+            ctx->bytesRead += payloadSize;
 
-            int readBytes = readByteSerialPort(&curr_byte);
-            if (readBytes < 0)
-            {
-                printf("error\n");
-                exit(-1);
-            }
-            if (readBytes == 0)
+            printf("CORRECT RR SENT\n");
+            printf("Sequence Number: %d\n", ch->sequenceNumber);
+            printf("--------------------------\n");
+            return payloadSize;
+        }
+        if (!ctx->isValid)
+        {
+            ch->sequenceNumber == 0 ? buildCtrlWord(ctx, ADDRESS_RX, REJ0) : buildCtrlWord(ctx, ADDRESS_RX, REJ1);
+            printf("REJ SENT\n");
+            ctx->stats.errorFrames++;
+        }
+    }
+}
+
+int ll_read_channel_ctx(LinkLayerCtx *ctx, int channel, unsigned char *packet)
+{
+    if (channel < 0 || channel >= ctx->agreed.channels)
+        return -1;
+    if (channel == 0)
+        return ll_read_ctx(ctx, packet);
+    return llreadQueued(ctx, &ctx->channels[channel], packet);
+}
+
+int ll_read_any_ctx(LinkLayerCtx *ctx, int *channel, unsigned char *packet)
+{
+    *channel = 0;
+    if (ctx->ioThread || !queuesReceived(ctx))
+        return ll_read_ctx(ctx, packet);
+
+    while (TRUE)
+    {
+        for (int i = 0; i < ctx->agreed.channels; i++)
+        {
+            LinkChannel *ch = &ctx->channels[(ctx->readTurn + i) % ctx->agreed.channels];
+            if (ch->reorder[ch->sequenceNumber].received)
             {
-                continue;
+                ctx->readTurn = (ch->id + 1) % ctx->agreed.channels;
+                *channel = ch->id;
+                return deliverReordered(ctx, ch, packet);
             }
+        }
+        serviceWindow(ctx);
+    }
+}
 
-            // printf("Read byte: 0x%02X\n", curr_byte);
+////////////////////////////////////////////////
+// Asynchronous requests
+////////////////////////////////////////////////
 
-            result = processCtrlByte(&sm, ADDRESS_RX, UA, curr_byte, readbuf, &bufferPosition);
-        }
-        if (alarmCount == connectionParameters.nRetransmissions)
+// Requests wait in their channel's queues, and ll_pump_ctx does what the
+// blocking calls would, as far as it can without waiting: writes are framed
+// into the window when it has room, received I-frames wait in the reorder
+// until a read takes them, and each callback is called once its I-frame is
+// acknowledged or its packet received. The timers and the serial port are
+// the ones the blocking calls wait on, so pollFd watches them, and wakeFd
+// for the requests.
+
+void closeAsyncFds(LinkLayerCtx *ctx)
+{
+    if (ctx->pollFd >= 0)
+        close(ctx->pollFd);
+    if (ctx->wakeFd >= 0)
+        close(ctx->wakeFd);
+    ctx->pollFd = -1;
+    ctx->wakeFd = -1;
+    ctx->asyncIo = FALSE;
+}
+
+// Sets up the asynchronous interface on its first use.
+// Returns -1 on error.
+int enableAsync(LinkLayerCtx *ctx)
+{
+    if (ctx->asyncIo)
+        return 1;
+    if (ctx->port.fd < 0 || ctx->agreed.arq == LlStopAndWait)
+        return -1;
+
+    ctx->pollFd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ctx->pollFd < 0 || ctx->wakeFd < 0)
+    {
+        perror("epoll/eventfd");
+        closeAsyncFds(ctx);
+        return -1;
+    }
+    int fds[] = {ctx->port.fd, ctx->timerFd, ctx->wakeFd};
+    for (int i = 0; i < 3; i++)
+    {
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.fd = fds[i];
+        if (epoll_ctl(ctx->pollFd, EPOLL_CTL_ADD, fds[i], &event) < 0)
         {
-            printf("Maximum retransmissions reached. Exiting...\n");
+            perror("epoll_ctl");
+            closeAsyncFds(ctx);
             return -1;
         }
-        if (!result)
-        {
-            printf("UA received\n");
-            alarm(0);
-        }
     }
-
-    return fd;
+    ctx->asyncIo = TRUE;
+    return 1;
 }
 
-////////////////////////////////////////////////
-// LLWRITE
-////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize)
+void signalEventFd(int fd)
 {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+        perror("eventfd");
+}
 
-    int stuffedSize = 0;
-    unsigned char *stuffedFrame = createIFrame(buf, bufSize, &stuffedSize);
+// Makes pollFd readable, so the next ll_pump_ctx looks at the new request
+void wakePump(LinkLayerCtx *ctx)
+{
+    signalEventFd(ctx->wakeFd);
+}
 
-    (void)signal(SIGALRM, alarmHandler);
+int ll_write_async_ctx(LinkLayerCtx *ctx, int channel, const unsigned char *buf, int bufSize, LinkLayerCallback done, void *userData)
+{
+    if (channel < 0 || channel >= ctx->agreed.channels || bufSize < 0 || bufSize > ctx->maxPayloadSize || enableAsync(ctx) < 0)
+        return -1;
+    LinkChannel *ch = &ctx->channels[channel];
+    if (ch->writesCount == LL_MAX_ASYNC_REQUESTS)
+        return -1;
+
+    AsyncRequest *request = &ch->writes[(ch->writesFirst + ch->writesCount) % LL_MAX_ASYNC_REQUESTS];
+    request->iov.iov_base = (void *)buf;
+    request->iov.iov_len = bufSize;
+    request->done = done;
+    request->userData = userData;
+    ch->writesCount++;
+    wakePump(ctx);
+    return 1;
+}
 
-    // SET UP STATE MACHINE AND BUFFER
-    StateMachine sm;
-    sm.currentState = START_STATE;
+int ll_read_async_ctx(LinkLayerCtx *ctx, int channel, unsigned char *packet, LinkLayerCallback done, void *userData)
+{
+    if (channel < 0 || channel >= ctx->agreed.channels || enableAsync(ctx) < 0)
+        return -1;
+    LinkChannel *ch = &ctx->channels[channel];
+    if (ch->readsCount == LL_MAX_ASYNC_REQUESTS)
+        return -1;
+
+    AsyncRequest *request = &ch->reads[(ch->readsFirst + ch->readsCount) % LL_MAX_ASYNC_REQUESTS];
+    request->packet = packet;
+    request->done = done;
+    request->userData = userData;
+    ch->readsCount++;
+    wakePump(ctx);
+    return 1;
+}
 
-    // Wait for acknowledgment frame (RR or REJ)
-    unsigned char ackFrame[CTRL_BUF_SIZE];
-    unsigned char curr_byte;
-    int bufferPosition = 0;
-    int result = -1;
-    int bytesSent = 0;
-    resetAlarm();
+int ll_poll_fd_ctx(LinkLayerCtx *ctx)
+{
+    if (enableAsync(ctx) < 0)
+        return -1;
+    return ctx->pollFd;
+}
 
-    // Retransmission logic
-    while (alarmCount < cp.nRetransmissions && result < 0)
+// Frames the queued writes the windows have room for
+void frameAsyncWrites(LinkLayerCtx *ctx)
+{
+    for (int i = 0; i < ctx->agreed.channels; i++)
     {
-
-        if (alarmEnabled == FALSE)
+        LinkChannel *ch = &ctx->channels[i];
+        while (ch->writesFramed < ch->writesCount && ch->outstanding < ctx->agreed.windowSize)
         {
-            // Send the frame
-            bytesSent = writeBytesSerialPort(stuffedFrame, stuffedSize);
-            printf("Sent I Frame\n");
-            stats.framesSent++;
-            printf("BCC2: 0x%02X\n", stuffedFrame[stuffedSize - 3]);
-            // Start timer
-            alarm(cp.timeout);
-            alarmEnabled = TRUE;
+            AsyncRequest *request = &ch->writes[(ch->writesFirst + ch->writesFramed) % LL_MAX_ASYNC_REQUESTS];
+            WindowSlot *slot = queueWindowFrame(ctx, ch, &request->iov, 1);
+            slot->async = TRUE;
+            request->result = slot->size;
+            ch->writesFramed++;
         }
+    }
+}
 
-        int readBytes = readByteSerialPort(&curr_byte);
+// Handles expired timers and gives the I-frames the windows have room for
+// to the line
+void startAsyncWrites(LinkLayerCtx *ctx)
+{
+    frameAsyncWrites(ctx);
+    for (int i = 0; i < ctx->agreed.channels; i++)
+        retransmitOnTimeout(ctx, &ctx->channels[i]);
+    transmitQueued(ctx);
+}
 
-        if (readBytes < 0)
+// Calls the callbacks of the requests that completed, each taken off its
+// queue first so the callback may queue another.
+// Returns how many were called.
+int completeAsync(LinkLayerCtx *ctx)
+{
+    int completed = 0;
+    for (int i = 0; i < ctx->agreed.channels; i++)
+    {
+        LinkChannel *ch = &ctx->channels[i];
+        while (ch->writesAcked > 0)
         {
-            printf("error\n");
-            exit(-1);
+            AsyncRequest request = ch->writes[ch->writesFirst];
+            ch->writesFirst = (ch->writesFirst + 1) % LL_MAX_ASYNC_REQUESTS;
+            ch->writesCount--;
+            ch->writesFramed--;
+            ch->writesAcked--;
+            if (request.done != NULL)
+                request.done(request.result, request.userData);
+            completed++;
         }
-        if (readBytes == 0)
-            continue;
-
-        //printf("Read byte: 0x%02X\n", curr_byte);
-
-        // State Machine processing
-        // Process the acceptance or rejection frame sent back by the receiver
-        result = processCtrlByte(&sm, ADDRESS_RX, IControlByte, curr_byte, ackFrame, &bufferPosition);
-
-        if (result == 0)
+        while (ch->readsCount > 0 && ch->reorder[ch->sequenceNumber].received)
         {
-            if ((ackFrame[2] == RR0 && sequenceNumber == 0) || (ackFrame[2] == RR1 && sequenceNumber == 1))
-            {
-                printf("Repeated frame. Retransmiting...\n");
-                stats.framesRetransmitted++;
-                // SET UP STATE MACHINE AND BUFFER
-                sm.currentState = START_STATE;
-                
-
-                // Wait for acknowledgment frame (RR or REJ)
-                bufferPosition = 0;
-                result = -1;
-                bytesSent = 0;
+            AsyncRequest request = ch->reads[ch->readsFirst];
+            ch->readsFirst = (ch->readsFirst + 1) % LL_MAX_ASYNC_REQUESTS;
+            ch->readsCount--;
+            int size = deliverReordered(ctx, ch, request.packet);
+            if (request.done != NULL)
+                request.done(size, request.userData);
+            completed++;
+        }
+    }
+    return completed;
+}
 
-                alarmEnabled = FALSE;
+int ll_pump_ctx(LinkLayerCtx *ctx)
+{
+    if (enableAsync(ctx) < 0)
+        return -1;
+    uint64_t wakes;
+    if (read(ctx->wakeFd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+        perror("eventfd");
+
+    // Every frame already received is handled, as acknowledgments make room
+    // in the windows for more writes. Each packet goes to its read at once,
+    // since the receive window only moves past packets taken by a read.
+    int completed = 0;
+    while (TRUE)
+    {
+        startAsyncWrites(ctx);
+        if (!receiveFrameWait(ctx, FALSE))
+            break;
+        if (isAckFrame(ctx))
+            handleAckFrame(ctx);
+        else
+            handleQueuedFrame(ctx);
+        completed += completeAsync(ctx);
+    }
+    // The timer may have been what stopped the reception
+    startAsyncWrites(ctx);
 
-                continue;
-            }
-            if ((ackFrame[2] == RR0 && sequenceNumber == 1) || (ackFrame[2] == RR1 && sequenceNumber == 0))
-            {
-                printf("Acknowledged frame.\n");
-                alarm(0);
-                sequenceNumber = (sequenceNumber + 1) % 2; // Update Sequence Number
-                break;
-            }
-            if (ackFrame[2] == REJ0 || ackFrame[2] == REJ1)
-            {
-                printf("Frame rejected. Retransmiting...\n");
-                stats.framesRetransmitted++;
-                alarmEnabled = FALSE;
-                
+    return completed + completeAsync(ctx);
+}
 
-                // reset variables
+// Completes the requests still pending when the link closes with -1 (writes
+// already acknowledged with their result) and closes the descriptors
+void releaseAsync(LinkLayerCtx *ctx)
+{
+    for (int i = 0; i < LL_MAX_CHANNELS; i++)
+    {
+        LinkChannel *ch = &ctx->channels[i];
+        for (; ch->writesCount > 0; ch->writesCount--)
+        {
+            AsyncRequest *request = &ch->writes[ch->writesFirst];
+            ch->writesFirst = (ch->writesFirst + 1) % LL_MAX_ASYNC_REQUESTS;
+            if (request->done != NULL)
+                request->done(ch->writesAcked-- > 0 ? request->result : -1, request->userData);
+        }
+        for (; ch->readsCount > 0; ch->readsCount--)
+        {
+            AsyncRequest *request = &ch->reads[ch->readsFirst];
+            ch->readsFirst = (ch->readsFirst + 1) % LL_MAX_ASYNC_REQUESTS;
+            if (request->done != NULL)
+                request->done(-1, request->userData);
+        }
+        ch->writesFramed = 0;
+        ch->writesAcked = 0;
+    }
+    closeAsyncFds(ctx);
+}
 
-                // SET UP STATE MACHINE AND BUFFER
-                sm.currentState = START_STATE;
+////////////////////////////////////////////////
+// I/O thread
+////////////////////////////////////////////////
 
-                // Wait for acknowledgment frame (RR or REJ)
-                bufferPosition = 0;
-                result = -1;
-                bytesSent = 0;
+// With ioThread, a thread of the link drives it through the asynchronous
+// requests above, and llwrite and llread only use two packet rings: the
+// application fills txRing and empties rxRing, the thread does the opposite.
+// Each side only moves its own index of a ring, so they need no lock. The
+// eventfds wake a side that waits for the other.
 
-                continue;
-            }
-        }
-    }
+// Packets of a ring the link thread sends or receives into
+#define IO_RING_SIZE LL_MAX_ASYNC_REQUESTS
 
-    if(alarmCount >= cp.nRetransmissions)
+void freeIoRings(LinkLayerCtx *ctx)
+{
+    for (int i = 0; i < IO_RING_SIZE; i++)
     {
-        printf("Maximum retransmissions reached. Exiting...\n");
-        exit(-1);
+#ifndef LL_NO_HEAP
+        free(ctx->txRing.data[i]);
+        free(ctx->rxRing.data[i]);
+#endif
+        ctx->txRing.data[i] = NULL;
+        ctx->rxRing.data[i] = NULL;
     }
-    free(stuffedFrame);
-    return bytesSent;
+    if (ctx->linkWakeFd >= 0)
+        close(ctx->linkWakeFd);
+    if (ctx->appWakeFd >= 0)
+        close(ctx->appWakeFd);
+    ctx->linkWakeFd = -1;
+    ctx->appWakeFd = -1;
 }
 
-////////////////////////////////////////////////
-// LLREAD
-////////////////////////////////////////////////
-int llread(unsigned char *packet)
+// Link thread: a packet of txRing was acknowledged, or failed (-1). Its
+// slot is freed either way; a failure is reported by the next llwrite and
+// by llclose.
+void ioWriteDone(int result, void *userData)
 {
+    LinkLayerCtx *ctx = (LinkLayerCtx *)userData;
+    PacketRing *ring = &ctx->txRing;
+    if (result < 0)
+        atomic_store(&ctx->ioWriteFailed, TRUE);
+    atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + 1, memory_order_release);
+    signalEventFd(ctx->appWakeFd);
+}
 
-    memset(packet, 0, 504 * sizeof(unsigned char)); // Adjust size as necessary
-    StateMachine sm;
-    sm.currentState = START_STATE;
-    unsigned char curr_byte;
-    unsigned char *buffer = (unsigned char *)malloc(1); // Initialize buffer
-    if (buffer == NULL)
-    {
-        printf("Memory allocation failed\n");
-        exit(-1);
-    }
-    int bufferPosition = 0;
+// Link thread: a packet was received into the next slot of rxRing
+void ioReadDone(int result, void *userData)
+{
+    LinkLayerCtx *ctx = (LinkLayerCtx *)userData;
+    PacketRing *ring = &ctx->rxRing;
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->size[tail % IO_RING_SIZE] = result;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    signalEventFd(ctx->appWakeFd);
+}
+
+void *runIoThread(void *arg)
+{
+    LinkLayerCtx *ctx = (LinkLayerCtx *)arg;
+    PacketRing *tx = &ctx->txRing;
+    PacketRing *rx = &ctx->rxRing;
+    struct pollfd fds[2] = {{ctx->pollFd, POLLIN, 0}, {ctx->linkWakeFd, POLLIN, 0}};
 
-    // message
-    unsigned char *message = (unsigned char *)malloc(1); // Initialize buffer
-        if (message == NULL)
+    while (TRUE)
     {
-        printf("Memory allocation failed\n");
-        exit(-1);
-    }
+        uint64_t wakes;
+        if (read(ctx->linkWakeFd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+            perror("eventfd");
+        int stop = atomic_load(&ctx->ioStop);
+
+        // Packets the application added are sent, and the slots it emptied
+        // wait for the next ones received
+        unsigned int txTail = atomic_load_explicit(&tx->tail, memory_order_acquire);
+        for (; ctx->txSubmitted != txTail; ctx->txSubmitted++)
+        {
+            int slot = ctx->txSubmitted % IO_RING_SIZE;
+            if (ll_write_async_ctx(ctx, 0, tx->data[slot], tx->size[slot], ioWriteDone, ctx) < 0)
+                ioWriteDone(-1, ctx);
+        }
+        unsigned int rxHead = atomic_load_explicit(&rx->head, memory_order_acquire);
+        for (; ctx->rxPosted != rxHead + IO_RING_SIZE; ctx->rxPosted++)
+            ll_read_async_ctx(ctx, 0, rx->data[ctx->rxPosted % IO_RING_SIZE], ioReadDone, ctx);
 
-    int charsRead = 0;
-    isValid = FALSE;
-    isRepeated = FALSE;
+        ll_pump_ctx(ctx);
 
-    // just process the byte  + destuffing
-    printf("Processing...\n");
-    do
-    {
-        int readBytes = readByteSerialPort(&curr_byte);
-        if (readBytes < 0)
+        // Closing waits for every packet handed over to be acknowledged
+        if (stop && atomic_load_explicit(&tx->head, memory_order_relaxed) == txTail)
+            break;
+        if (poll(fds, 2, -1) < 0)
         {
-            printf("error\n");
+            perror("poll");
             exit(-1);
         }
-        if (readBytes == 0)
+    }
+    return NULL;
+}
+
+// Starts the link thread on an open link.
+// Returns -1 on error.
+int startIoThread(LinkLayerCtx *ctx)
+{
+    if (ctx->agreed.arq == LlStopAndWait || ctx->agreed.channels > 1)
+    {
+        printf("The I/O thread needs the sliding window and a single channel, running without it.\n");
+        return 1;
+    }
+
+    memset(&ctx->txRing, 0, sizeof(ctx->txRing));
+    memset(&ctx->rxRing, 0, sizeof(ctx->rxRing));
+    ctx->txSubmitted = 0;
+    ctx->rxPosted = 0;
+    atomic_store(&ctx->ioStop, FALSE);
+    atomic_store(&ctx->ioWriteFailed, FALSE);
+#ifndef LL_NO_HEAP
+    for (int i = 0; i < IO_RING_SIZE; i++)
+    {
+        ctx->txRing.data[i] = (unsigned char *)malloc(ctx->maxPayloadSize);
+        ctx->rxRing.data[i] = (unsigned char *)malloc(ctx->maxPayloadSize);
+        if (ctx->txRing.data[i] == NULL || ctx->rxRing.data[i] == NULL)
         {
-            continue;
+            printf("Memory allocation failed\n");
+            return -1;
         }
+    }
+#endif
+    ctx->linkWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ctx->appWakeFd = eventfd(0, EFD_CLOEXEC);
+    if (ctx->linkWakeFd < 0 || ctx->appWakeFd < 0)
+    {
+        perror("eventfd");
+        return -1;
+    }
+    if (enableAsync(ctx) < 0)
+        return -1;
 
-    } while (processInfoByte(&sm, ADDRESS_TX, sequenceNumber, curr_byte, &buffer, &bufferPosition, &message, &charsRead) != 0);
+    // Anything printed before is not printed again by the thread
+    fflush(stdout);
+    if (pthread_create(&ctx->ioThreadId, NULL, runIoThread, ctx) != 0)
+    {
+        printf("Failed to start the I/O thread\n");
+        return -1;
+    }
+    ctx->ioThread = TRUE;
+    printf("Link I/O thread started\n");
+    return 1;
+}
 
+// Waits for every packet handed to the link thread to be acknowledged and
+// ends the thread, leaving the link to the caller.
+// Returns -1 if one of the packets could not be sent.
+int stopIoThread(LinkLayerCtx *ctx)
+{
+    if (!ctx->ioThread)
+        return 1;
+    atomic_store(&ctx->ioStop, TRUE);
+    signalEventFd(ctx->linkWakeFd);
+    pthread_join(ctx->ioThreadId, NULL);
+    ctx->ioThread = FALSE;
+    return atomic_load(&ctx->ioWriteFailed) ? -1 : 1;
+}
 
-    printf("Number of bytes read: %d\n", charsRead - 1);
-    stats.framesReceived++;
-    printf("BCC2: 0x%02X\n", message[charsRead - 1]);
-    // Send RR|REJ
-    if (isValid && isRepeated)
+// Waits until the link thread used a ring
+void waitIoThread(LinkLayerCtx *ctx)
+{
+    uint64_t wakes;
+    if (read(ctx->appWakeFd, &wakes, sizeof(wakes)) < 0)
     {
-        sequenceNumber == 0 ? buildCtrlWord(ADDRESS_RX, RR0) : buildCtrlWord(ADDRESS_RX, RR1);
-        printf("REPEATED RR SENT\n");
-        stats.errorFrames++;
+        perror("eventfd");
+        exit(-1);
     }
-    if (isValid && !isRepeated)
-    {
-        sequenceNumber == 1 ? buildCtrlWord(ADDRESS_RX, RR0) : buildCtrlWord(ADDRESS_RX, RR1);
-
-        // change sequenceNumber
-        sequenceNumber = (sequenceNumber + 1) % 2;
-        sequenceChar = (sequenceChar == C0) ? C1 : C0;
+}
 
-        // printf("SAVING PACKET\n");
-        for (int i = 0; i < charsRead - 1; i++)
-        {
-            packet[i] = message[i];
-        }
+// llwritev with the link thread: the packet is copied to txRing, waiting
+// only while the ring is full.
+// Returns the size of the packet rather than of its frame, which the thread
+// builds later, or -1 if a packet handed over before could not be sent.
+int ioThreadWrite(LinkLayerCtx *ctx, const struct iovec *iov, int iovcnt)
+{
+    int size = iovecSize(iov, iovcnt);
+    if (size > ctx->maxPayloadSize || atomic_load(&ctx->ioWriteFailed))
+        return -1;
 
-        totalPacketsRead++;
+    PacketRing *ring = &ctx->txRing;
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == IO_RING_SIZE)
+        waitIoThread(ctx);
 
-        printf("CORRECT RR SENT\n");
-    }
-    if (!isValid)
+    unsigned char *data = ring->data[tail % IO_RING_SIZE];
+    for (int i = 0; i < iovcnt; i++)
     {
-        sequenceNumber == 0 ? buildCtrlWord(ADDRESS_RX, REJ0) : buildCtrlWord(ADDRESS_RX, REJ1);
-        /*
-                for (int i = 0; i < 10; i++)
-                {
-                    printf("Message byte : 0x%02X\n", message[i]);
-                }
-                degub = TRUE;
-        */
-        printf("REJ SENT\n");
-        stats.errorFrames++;
+        memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        data += iov[i].iov_len;
     }
-    bytesRead += charsRead - 1;
-    free(message);
-    free(buffer);
-    printf("Sequence Number: %d\n", sequenceNumber);
+    ring->size[tail % IO_RING_SIZE] = size;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    signalEventFd(ctx->linkWakeFd);
+    return size;
+}
 
-    printf("--------------------------\n");
-    return charsRead - 1;
+// llread with the link thread: the next packet of rxRing
+int ioThreadRead(LinkLayerCtx *ctx, unsigned char *packet)
+{
+    PacketRing *ring = &ctx->rxRing;
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head)
+        waitIoThread(ctx);
+
+    int size = ring->size[head % IO_RING_SIZE];
+    if (size > 0)
+        memcpy(packet, ring->data[head % IO_RING_SIZE], size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    signalEventFd(ctx->linkWakeFd);
+    return size;
 }
+
 // rr0 and se
+// Frees the buffers, the timer and the serial port of a link, whatever state
+// it was left in.
+// Returns -1 if the serial port could not be closed.
+int releaseLink(LinkLayerCtx *ctx)
+{
+    releaseAsync(ctx);
+    freeIoRings(ctx);
+    freeFrameBuffers(ctx);
+    if (ctx->timerFd >= 0)
+        close(ctx->timerFd);
+    ctx->timerFd = -1;
+
+    int result = 0;
+    if (ctx->port.fd >= 0)
+        result = closeSerialPortCtx(&ctx->port);
+    ctx->port.fd = -1;
+    return result;
+}
+
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
-int llclose(int showStatistics)
+// Disconnects and releases everything the link holds, but not ctx itself.
+// Returns 1 on success or -1 on error.
+int closeLink(LinkLayerCtx *ctx, int showStatistics)
 {
     // show statistics
+    int ioFailed = stopIoThread(ctx) < 0;
+    sendPendingAcks(ctx);
 
-    if (cp.role == LlRx)
+    if (ctx->cp.role == LlRx && queuesReceived(ctx))
+    {
+        // Our own I-frames are acknowledged first, the other side's are
+        // still answered meanwhile
+        while (windowsOutstanding(ctx) > 0 || !ctx->discReceived)
+            serviceWindow(ctx);
+    }
+    if (ctx->cp.role == LlRx)
     {
-
-        StateMachine sm;
-        sm.currentState = START_STATE;
-
-        unsigned char buf[CTRL_BUF_SIZE] = {0};
-        unsigned char curr_byte;
-        int bufferPosition = 0;
-
         // reads DISC BYTE
-        do
-        {
-            int readBytes = readByteSerialPort(&curr_byte);
-            if (readBytes < 0)
-            {
-                printf("error\n");
-                exit(-1);
-            }
-            if (readBytes == 0)
-            {
-                continue;
-            }
-            // printf("Read byte: 0x%02X\n", curr_byte);
-        } while (processCtrlByte(&sm, ADDRESS_TX, DISC, curr_byte, buf, &bufferPosition) != 0);
+        while (!ctx->discReceived && (!receiveFrame(ctx) || !isCtrlFrame(ctx, ADDRESS_TX, DISC)))
+            ;
         printf("DISC received\n");
 
-        // reset buffer/sm
-        bufferPosition = 0;
-        memset(buf, 0, sizeof(buf));
-        sm.currentState = START_STATE;
-        int result = -1;
+        int received = FALSE;
         // alarm setup
-        resetAlarm();
-        (void)signal(SIGALRM, alarmHandler);
+        resetAlarm(ctx);
 
         // READS UA BYTE
-        while (alarmCount < cp.nRetransmissions && result < 0)
+        while (ctx->alarmCount < ctx->cp.nRetransmissions && !received)
         {
-            if (alarmEnabled == FALSE)
+            if (ctx->alarmEnabled == FALSE)
             {
 
-                buildCtrlWord(ADDRESS_RX, DISC);
+                buildCtrlWord(ctx, ADDRESS_RX, DISC);
                 printf("sent DISC\n");
 
-                alarm(cp.timeout);
-                alarmEnabled = TRUE;
-            }
-
-            int readBytes = readByteSerialPort(&curr_byte);
-            if (readBytes < 0)
-            {
-                printf("error\n");
-                exit(-1);
-            }
-            if (readBytes == 0)
-            {
-                continue;
+                startAlarm(ctx);
             }
 
-            result = processCtrlByte(&sm, ADDRESS_TX, UA, curr_byte, buf, &bufferPosition);
+            received = receiveFrame(ctx) && isCtrlFrame(ctx, ADDRESS_TX, UA);
         }
 
-        if (!result)
+        if (received)
         {
             printf("UA received\n");
-            alarm(0);
+            stopAlarm(ctx);
         }
 
-        if (alarmCount == cp.nRetransmissions)
+        if (ctx->alarmCount == ctx->cp.nRetransmissions)
         {
             printf("Maximum retransmissions reached. Exiting...\n");
             return -1;
@@ -977,79 +2801,283 @@ int llclose(int showStatistics)
     }
     else
     {
+        // Every I-frame must be acknowledged before disconnecting
+        while (windowsOutstanding(ctx) > 0)
+            serviceWindow(ctx);
 
         // alarm setup
-        resetAlarm();
-        (void)signal(SIGALRM, alarmHandler);
-
-        // SET UP STATE MACHINE AND BUFFER
-        StateMachine sm;
-        sm.currentState = START_STATE;
-
-        unsigned char readbuf[CTRL_BUF_SIZE] = {0};
-        unsigned char curr_byte;
-        int bufferPosition = 0;
-        int result = -1;
+        resetAlarm(ctx);
+        int received = FALSE;
 
         // reads DISC BYTE
-        while (alarmCount < cp.nRetransmissions && result < 0)
+        while (ctx->alarmCount < ctx->cp.nRetransmissions && !received)
         {
-            if (alarmEnabled == FALSE)
+            if (ctx->alarmEnabled == FALSE)
             {
 
-                buildCtrlWord(ADDRESS_TX, DISC);
+                buildCtrlWord(ctx, ADDRESS_TX, DISC);
                 printf("sent DISC\n");
 
-                alarm(cp.timeout);
-                alarmEnabled = TRUE;
+                startAlarm(ctx);
             }
 
-            int readBytes = readByteSerialPort(&curr_byte);
-            if (readBytes < 0)
-            {
-                printf("error\n");
-                exit(-1);
-            }
-            if (readBytes == 0)
-            {
+            if (!receiveFrame(ctx))
                 continue;
+            received = isCtrlFrame(ctx, ADDRESS_RX, DISC);
+            if (!received && queuesReceived(ctx) && isInfoFrame(ctx))
+            {
+                // The other side is still finishing its own I-frames
+                handleQueuedFrame(ctx);
+                ctx->alarmCount = 0;
             }
-            result = processCtrlByte(&sm, ADDRESS_RX, DISC, curr_byte, readbuf, &bufferPosition);
         }
 
-        if (result == 0)
+        if (received)
         {
             printf("DISC received\n");
-            alarm(0);
+            stopAlarm(ctx);
         }
 
-        if (alarmCount == cp.nRetransmissions)
+        if (ctx->alarmCount == ctx->cp.nRetransmissions)
         {
             printf("Maximum retransmissions reached. Exiting...\n");
             return -1;
         }
 
         // sends UA BYTE
-        buildCtrlWord(ADDRESS_TX, UA);
+        buildCtrlWord(ctx, ADDRESS_TX, UA);
         printf("sent UA\n");
     }
 
-    time(&end);
-    double elapsed_time = difftime(end, start);
+    double elapsed_time = (nowMicros() - ctx->openedAt) / 1000000.0;
 
     if (showStatistics)
     {
+        // A duplex link does both
+        int sends = ctx->cp.role == LlTx || ctx->agreed.duplex;
+        int receives = ctx->cp.role == LlRx || ctx->agreed.duplex;
         printf("---- Statistics ----\n");
-        if (cp.role == LlTx) printf("Frames Sent: %d\n", stats.framesSent);
-        if (cp.role == LlRx) printf("Frames Received: %d\n", stats.framesReceived);
-        if (cp.role == LlRx) printf("Frames With Error: %d\n", stats.errorFrames);
-        if (cp.role == LlTx) printf("Frames Retransmitted: %d\n", stats.framesRetransmitted);
+        if (sends) printf("Frames Sent: %d\n", ctx->stats.framesSent);
+        if (receives) printf("Frames Received: %d\n", ctx->stats.framesReceived);
+        if (receives) printf("Frames With Error: %d\n", ctx->stats.errorFrames);
+        if (sends) printf("Frames Retransmitted: %d\n", ctx->stats.framesRetransmitted);
+        if (sends) printf("Timeouts: %d\n", ctx->stats.timeouts);
+        if (sends) printf("Rejects Received: %d\n", ctx->stats.rejectsReceived);
+        if (sends && ctx->options.adaptivePayload) printf("Final Frame Payload: %d bytes\n", ctx->payloadTarget);
+        if (sends && ctx->agreed.arq == LlSelectiveRepeat) printf("Frames Selectively Retransmitted: %d\n", ctx->stats.framesSelectiveRetransmitted);
+        if (receives && ctx->agreed.arq == LlSelectiveRepeat) printf("Selective Rejects Sent: %d\n", ctx->stats.selectiveRejects);
+        if (ctx->agreed.fecParity > 0) printf("FEC Overhead: %.1f%% (RS(%d,%d))\n", ctx->stats.fecDataBytes ? 100.0 * ctx->stats.fecParityBytes / ctx->stats.fecDataBytes : 0.0, FEC_BLOCK_SIZE, FEC_BLOCK_SIZE - ctx->agreed.fecParity);
+        if (receives && ctx->agreed.fecParity > 0) printf("Frames Repaired by FEC: %d (%d bytes corrected)\n", ctx->stats.fecRepairedFrames, ctx->stats.fecCorrectedBytes);
+        if (sends && ctx->srtt > 0) printf("Smoothed RTT: %.1f ms\n", ctx->srtt / 1000.0);
+        if (sends) printf("Retransmission Timeout: %.1f ms\n", ctx->retransmissionTimeout / 1000.0);
+        if (ctx->agreed.duplex) printf("Acknowledgments Piggybacked: %d\n", ctx->stats.piggybackedAcks);
+        for (int i = 0; i < ctx->agreed.channels && ctx->agreed.channels > 1; i++)
+        {
+            if (sends) printf("Channel %d Frames Sent: %d\n", i, ctx->stats.channelFramesSent[i]);
+            if (receives) printf("Channel %d Packets Read: %d\n", i, ctx->stats.channelPacketsRead[i]);
+        }
+        if (ctx->stats.outages > 0)
+        {
+            printf("Outages: %d\n", ctx->stats.outages);
+            for (int i = 0; i < ctx->stats.outages && i < MAX_OUTAGES_SHOWN; i++)
+                printf("Outage %d Downtime: %.1f seconds\n", i + 1, ctx->stats.outageMicros[i] / 1000000.0);
+            printf("Total Downtime: %.1f seconds\n", ctx->stats.downtimeMicros / 1000000.0);
+        }
         printf("Total Time: %.1f seconds\n", elapsed_time);
-        if (cp.role == LlRx) printf("Bytes Read: %ld\n", bytesRead);
-        if (cp.role == LlRx) printf("Packets Read : %d\n", totalPacketsRead);
+        if (receives) printf("Bytes Read: %ld\n", ctx->bytesRead);
+        if (receives) printf("Packets Read : %d\n", ctx->totalPacketsRead);
         printf("--------------------\n");
     }
 
-    int clstat = closeSerialPort();
-    return clstat;
+    if (ctx->options.metricsFile != NULL)
+        reportMetrics(ctx, TRUE);
+
+    int clstat = releaseLink(ctx);
+    return ioFailed ? -1 : clstat;
+}
+
+////////////////////////////////////////////////
+// Link handles
+////////////////////////////////////////////////
+
+#ifdef LL_NO_HEAP
+static LinkLayerCtx ctxPool[LL_MAX_CONTEXTS];
+static pthread_mutex_t ctxPoolLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Returns a link with nothing open, or NULL if none is left
+LinkLayerCtx *allocCtx()
+{
+    LinkLayerCtx *ctx = NULL;
+#ifdef LL_NO_HEAP
+    pthread_mutex_lock(&ctxPoolLock);
+    for (int i = 0; i < LL_MAX_CONTEXTS && ctx == NULL; i++)
+    {
+        if (!ctxPool[i].inUse)
+        {
+            ctx = &ctxPool[i];
+            memset(ctx, 0, sizeof(*ctx));
+            ctx->inUse = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&ctxPoolLock);
+#else
+    ctx = (LinkLayerCtx *)calloc(1, sizeof(LinkLayerCtx));
+#endif
+    if (ctx == NULL)
+        return NULL;
+    ctx->port.fd = -1;
+    ctx->timerFd = -1;
+    ctx->pollFd = -1;
+    ctx->wakeFd = -1;
+    ctx->linkWakeFd = -1;
+    ctx->appWakeFd = -1;
+    return ctx;
+}
+
+void freeCtx(LinkLayerCtx *ctx)
+{
+#ifdef LL_NO_HEAP
+    pthread_mutex_lock(&ctxPoolLock);
+    ctx->inUse = FALSE;
+    pthread_mutex_unlock(&ctxPoolLock);
+#else
+    free(ctx);
+#endif
+}
+
+LinkLayerCtx *ll_open_ctx(LinkLayer connectionParameters, const LinkLayerOptions *options)
+{
+    LinkLayerCtx *ctx = allocCtx();
+    if (ctx == NULL)
+    {
+        printf("No link available\n");
+        return NULL;
+    }
+
+    ctx->options = clampOptions(options != NULL ? *options : lldefaultoptions());
+    if (openLink(ctx, connectionParameters) < 0)
+    {
+        releaseLink(ctx);
+        freeCtx(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int ll_close_ctx(LinkLayerCtx *ctx, int showStatistics)
+{
+    int result = closeLink(ctx, showStatistics);
+    releaseLink(ctx);
+    freeCtx(ctx);
+    return result;
+}
+
+////////////////////////////////////////////////
+// Default link
+////////////////////////////////////////////////
+// Link of the functions without a handle
+static LinkLayerCtx defaultCtx = {.port.fd = -1, .timerFd = -1, .pollFd = -1, .wakeFd = -1,
+                                   .linkWakeFd = -1, .appWakeFd = -1};
+static LinkLayerOptions defaultOptions = BASE_OPTIONS; // Requested through llsetoptions
+
+LinkLayerOptions lldefaultoptions()
+{
+    return (LinkLayerOptions)BASE_OPTIONS;
+}
+
+void llsetoptions(LinkLayerOptions options)
+{
+    defaultOptions = clampOptions(options);
+}
+
+int llopen(LinkLayer connectionParameters)
+{
+    defaultCtx.options = defaultOptions;
+    return openLink(&defaultCtx, connectionParameters);
+}
+
+int llwrite(const unsigned char *buf, int bufSize)
+{
+    return ll_write_ctx(&defaultCtx, buf, bufSize);
+}
+
+int llwritev(const struct iovec *iov, int iovcnt)
+{
+    return ll_writev_ctx(&defaultCtx, iov, iovcnt);
+}
+
+int llmaxpayload()
+{
+    return ll_maxpayload_ctx(&defaultCtx);
+}
+
+int llpreferredpayload()
+{
+    return ll_preferredpayload_ctx(&defaultCtx);
+}
+
+int llduplex()
+{
+    return ll_duplex_ctx(&defaultCtx);
+}
+
+int llread(unsigned char *packet)
+{
+    return ll_read_ctx(&defaultCtx, packet);
+}
+
+int llresumeoffset()
+{
+    return ll_resume_offset_ctx(&defaultCtx);
+}
+
+int llchannels()
+{
+    return ll_channels_ctx(&defaultCtx);
+}
+
+int llwritechannel(int channel, const unsigned char *buf, int bufSize)
+{
+    return ll_write_channel_ctx(&defaultCtx, channel, buf, bufSize);
+}
+
+int llwritevchannel(int channel, const struct iovec *iov, int iovcnt)
+{
+    return ll_writev_channel_ctx(&defaultCtx, channel, iov, iovcnt);
+}
+
+int llreadchannel(int channel, unsigned char *packet)
+{
+    return ll_read_channel_ctx(&defaultCtx, channel, packet);
+}
+
+int llreadany(int *channel, unsigned char *packet)
+{
+    return ll_read_any_ctx(&defaultCtx, channel, packet);
+}
+
+int llwrite_async(const unsigned char *buf, int bufSize, LinkLayerCallback done, void *userData)
+{
+    return ll_write_async_ctx(&defaultCtx, 0, buf, bufSize, done, userData);
+}
+
+int llread_async(unsigned char *packet, LinkLayerCallback done, void *userData)
+{
+    return ll_read_async_ctx(&defaultCtx, 0, packet, done, userData);
+}
+
+int llpollfd()
+{
+    return ll_poll_fd_ctx(&defaultCtx);
+}
+
+int llpump()
+{
+    return ll_pump_ctx(&defaultCtx);
+}
+
+int llclose(int showStatistics)
+{
+    return closeLink(&defaultCtx, showStatistics);
 }
\ No newline at end of file
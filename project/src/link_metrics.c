@@ -0,0 +1,199 @@
+// Link telemetry
+//
+// The link layer hands over a snapshot of its counters; this file derives
+// the rates from it and writes it as JSON or in the Prometheus text format,
+// e.g. for node_exporter's textfile collector.
+
+#include "link_metrics.h"
+#include "serial_port_ctx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// 100 us to 10 s, roughly 1-2.5-5 per decade
+const long latencyBucketBounds[LATENCY_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+    50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+void histogramAdd(LatencyHistogram *histogram, long micros)
+{
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS && micros > latencyBucketBounds[bucket])
+        bucket++;
+    histogram->counts[bucket]++;
+    histogram->count++;
+    histogram->sumMicros += micros;
+}
+
+typedef struct
+{
+    const char *name; // Prometheus name without the rcom_ prefix, and JSON key
+    const char *type;
+    const char *help;
+    double value;
+} Metric;
+
+// Efficiency of stop-and-wait without errors, 1 / (1 + 2a) with
+// a = Tprop / Tframe. The frame time comes from the average I-frame at the
+// baud rate (LINE_BITS_PER_BYTE per byte, as the line sends it) and the
+// propagation delay from what the round trip adds to it.
+static double stopAndWaitEfficiency(const LinkMetrics *m)
+{
+    if (m->newFramesSent == 0 || m->baudRate <= 0)
+        return 0;
+    double frameTime = (double)LINE_BITS_PER_BYTE * m->stuffedFrameBytes / m->newFramesSent / m->baudRate;
+    double propagation = m->srttSeconds > frameTime ? (m->srttSeconds - frameTime) / 2 : 0;
+    return 1 / (1 + 2 * propagation / frameTime);
+}
+
+// Fills metrics with the snapshot and the values derived from it.
+// Returns how many there are.
+static int collectMetrics(const LinkMetrics *m, Metric *metrics)
+{
+    double payloadBytes = m->payloadBytesSent + m->payloadBytesReceived;
+    double payloadPerSecond = m->elapsedSeconds > 0 ? payloadBytes / m->elapsedSeconds : 0;
+    double goodput = 8 * payloadPerSecond;
+    // Against the bytes the line can carry, start and stop bits included, so
+    // a line busy with payload alone is 1 like the stop-and-wait estimate
+    double efficiency = m->baudRate > 0 ? payloadPerSecond * LINE_BITS_PER_BYTE / m->baudRate : 0;
+    double wireBytes = m->wireBytesSent + m->wireBytesReceived;
+    Metric all[] = {
+        {"elapsed_seconds", "gauge", "Time since the link opened", m->elapsedSeconds},
+        {"line_rate_bits_per_second", "gauge", "Baud rate of the serial port", m->baudRate},
+        {"goodput_bits_per_second", "gauge", "Payload delivered or acknowledged per second", goodput},
+        {"efficiency_ratio", "gauge", "Payload bytes per second over the bytes per second the line carries", efficiency},
+        {"stop_and_wait_efficiency_ratio", "gauge", "Stop-and-wait efficiency 1/(1+2a) expected at this baud rate and round trip", stopAndWaitEfficiency(m)},
+        {"frames_sent_total", "counter", "I-frames sent, retransmissions included", m->framesSent},
+        {"frames_received_total", "counter", "I-frames received", m->framesReceived},
+        {"frames_retransmitted_total", "counter", "I-frames sent again", m->framesRetransmitted},
+        {"error_frames_total", "counter", "I-frames received damaged", m->errorFrames},
+        {"timeouts_total", "counter", "Retransmission timeouts", m->timeouts},
+        {"rejects_received_total", "counter", "REJ and SREJ received", m->rejectsReceived},
+        {"selective_rejects_sent_total", "counter", "SREJ sent", m->selectiveRejects},
+        {"outages_total", "counter", "Times the retry limit was reached", m->outages},
+        {"downtime_seconds_total", "counter", "Time the link was down", m->downtimeSeconds},
+        {"wire_bytes_sent_total", "counter", "Bytes written to the serial port", m->wireBytesSent},
+        {"wire_bytes_received_total", "counter", "Bytes read from the serial port", m->wireBytesReceived},
+        {"payload_bytes_sent_total", "counter", "Payload of the I-frames acknowledged", m->payloadBytesSent},
+        {"payload_bytes_received_total", "counter", "Payload of the I-frames delivered", m->payloadBytesReceived},
+        {"payload_wire_ratio", "gauge", "Payload bytes over the bytes on the wire", wireBytes > 0 ? payloadBytes / wireBytes : 0},
+        {"stuffing_overhead_ratio", "gauge", "Bytes added by stuffing over the I-frame bytes before it", m->frameBytes > 0 ? (double)(m->stuffedFrameBytes - m->frameBytes) / m->frameBytes : 0},
+        {"srtt_seconds", "gauge", "Smoothed round-trip time", m->srttSeconds},
+    };
+    int count = sizeof(all) / sizeof(all[0]);
+    for (int i = 0; i < count; i++)
+        metrics[i] = all[i];
+    return count;
+}
+
+// Copies text to out (size bytes, truncating) as the body of a quoted
+// string: backslashes, quotes and line feeds are escaped as both JSON and
+// Prometheus label values expect, other control characters as JSON expects
+// (json) or dropped.
+static void escapeString(char *out, int size, const char *text, int json)
+{
+    int length = 0;
+    for (; *text != '\0'; text++)
+    {
+        char escaped[8];
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')
+            snprintf(escaped, sizeof(escaped), "\\%c", c);
+        else if (c == '\n')
+            snprintf(escaped, sizeof(escaped), "\\n");
+        else if (c < 0x20 && json)
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        else if (c < 0x20)
+            continue;
+        else
+            snprintf(escaped, sizeof(escaped), "%c", c);
+
+        int escapedLength = strlen(escaped);
+        if (length + escapedLength >= size)
+            break;
+        memcpy(&out[length], escaped, escapedLength);
+        length += escapedLength;
+    }
+    out[length] = '\0';
+}
+
+static void writeJson(FILE *out, const LinkMetrics *m, const Metric *metrics, int count)
+{
+    char role[64];
+    char port[1024];
+    escapeString(role, sizeof(role), m->role, TRUE);
+    escapeString(port, sizeof(port), m->port, TRUE);
+    fprintf(out, "{\n  \"role\": \"%s\",\n  \"port\": \"%s\",\n  \"final\": %s,\n", role, port, m->final ? "true" : "false");
+    for (int i = 0; i < count; i++)
+        fprintf(out, "  \"%s\": %.15g,\n", metrics[i].name, metrics[i].value);
+
+    const LatencyHistogram *h = &m->ackLatency;
+    fprintf(out, "  \"ack_latency_seconds\": {\n    \"buckets\": [");
+    long cumulative = 0;
+    for (int i = 0; i <= LATENCY_BUCKETS; i++)
+    {
+        cumulative += h->counts[i];
+        if (i < LATENCY_BUCKETS)
+            fprintf(out, "{\"le\": %g, \"count\": %ld}, ", latencyBucketBounds[i] / 1e6, cumulative);
+        else
+            fprintf(out, "{\"le\": \"+Inf\", \"count\": %ld}],\n", cumulative);
+    }
+    fprintf(out, "    \"sum\": %.15g,\n    \"count\": %ld\n  }\n}\n", h->sumMicros / 1e6, h->count);
+}
+
+static void writePrometheus(FILE *out, const LinkMetrics *m, const Metric *metrics, int count)
+{
+    char role[64];
+    char port[1024];
+    escapeString(role, sizeof(role), m->role, FALSE);
+    escapeString(port, sizeof(port), m->port, FALSE);
+    char labels[sizeof(role) + sizeof(port) + 16];
+    snprintf(labels, sizeof(labels), "role=\"%s\",port=\"%s\"", role, port);
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(out, "# HELP rcom_%s %s\n# TYPE rcom_%s %s\n", metrics[i].name, metrics[i].help, metrics[i].name, metrics[i].type);
+        fprintf(out, "rcom_%s{%s} %.15g\n", metrics[i].name, labels, metrics[i].value);
+    }
+
+    const LatencyHistogram *h = &m->ackLatency;
+    fprintf(out, "# HELP rcom_ack_latency_seconds Time from the first transmission of an I-frame to its acknowledgment\n");
+    fprintf(out, "# TYPE rcom_ack_latency_seconds histogram\n");
+    long cumulative = 0;
+    for (int i = 0; i <= LATENCY_BUCKETS; i++)
+    {
+        cumulative += h->counts[i];
+        if (i < LATENCY_BUCKETS)
+            fprintf(out, "rcom_ack_latency_seconds_bucket{%s,le=\"%g\"} %ld\n", labels, latencyBucketBounds[i] / 1e6, cumulative);
+        else
+            fprintf(out, "rcom_ack_latency_seconds_bucket{%s,le=\"+Inf\"} %ld\n", labels, cumulative);
+    }
+    fprintf(out, "rcom_ack_latency_seconds_sum{%s} %.15g\n", labels, h->sumMicros / 1e6);
+    fprintf(out, "rcom_ack_latency_seconds_count{%s} %ld\n", labels, h->count);
+}
+
+int writeMetrics(const char *path, LinkLayerMetricsFormat format, const LinkMetrics *metrics)
+{
+    // Written aside and renamed over the file
+    char tmpPath[1024];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    FILE *out = fopen(tmpPath, "w");
+    if (out == NULL)
+    {
+        perror("metrics");
+        return -1;
+    }
+
+    Metric all[32];
+    int count = collectMetrics(metrics, all);
+    if (format == LlMetricsPrometheus)
+        writePrometheus(out, metrics, all, count);
+    else
+        writeJson(out, metrics, all, count);
+
+    if (fclose(out) != 0 || rename(tmpPath, path) < 0)
+    {
+        perror("metrics");
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,233 @@
+// Reed-Solomon forward error correction
+//
+// Systematic RS codes over GF(256) (primitive polynomial x^8+x^4+x^3+x^2+1,
+// generator roots alpha^0 .. alpha^(nParity-1)). With 32 parity bytes this is
+// RS(255,223), correcting up to 16 damaged bytes per block. Shorter blocks
+// are decoded as codewords whose leading bytes are zero.
+
+#include "reed_solomon.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define GF_POLY 0x11D
+
+static unsigned char gfExp[2 * FEC_BLOCK_SIZE];
+static unsigned char gfLog[256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+// Generator polynomial of every parity size, highest degree first. All are
+// built up front, so links with different codes can encode at the same time.
+static unsigned char generators[MAX_FEC_PARITY + 1][MAX_FEC_PARITY + 1];
+
+static void buildGenerators();
+
+static void buildTables()
+{
+    int x = 1;
+    for (int i = 0; i < FEC_BLOCK_SIZE; i++)
+    {
+        gfExp[i] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+    // Doubled so products of two logarithms need no modulo
+    for (int i = FEC_BLOCK_SIZE; i < 2 * FEC_BLOCK_SIZE; i++)
+        gfExp[i] = gfExp[i - FEC_BLOCK_SIZE];
+    buildGenerators();
+}
+
+static unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    if (a == 0 || b == 0)
+        return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b)
+{
+    if (a == 0)
+        return 0;
+    return gfExp[gfLog[a] + FEC_BLOCK_SIZE - gfLog[b]];
+}
+
+// alpha^power, for any power
+static unsigned char gfPow(int power)
+{
+    power %= FEC_BLOCK_SIZE;
+    if (power < 0)
+        power += FEC_BLOCK_SIZE;
+    return gfExp[power];
+}
+
+// g(x) = (x - alpha^0)(x - alpha^1)...(x - alpha^(nParity-1)), each one the
+// previous times (x - alpha^(nParity-1))
+static void buildGenerators()
+{
+    generators[0][0] = 1;
+    for (int n = 1; n <= MAX_FEC_PARITY; n++)
+    {
+        memcpy(generators[n], generators[n - 1], n);
+        // Multiply by (x + alpha^(n-1)), coefficients highest degree first
+        for (int j = n; j > 0; j--)
+            generators[n][j] ^= gfMul(generators[n][j - 1], gfExp[n - 1]);
+    }
+}
+
+void rsEncodeUpdate(unsigned char *parity, int nParity, const unsigned char *data, int size)
+{
+    pthread_once(&tablesOnce, buildTables);
+    const unsigned char *generator = generators[nParity];
+
+    // Remainder of data * x^nParity divided by g(x), one byte at a time
+    for (int i = 0; i < size; i++)
+    {
+        unsigned char feedback = data[i] ^ parity[0];
+        if (feedback == 0)
+        {
+            memmove(parity, parity + 1, nParity - 1);
+            parity[nParity - 1] = 0;
+            continue;
+        }
+        int logFeedback = gfLog[feedback];
+        for (int j = 0; j < nParity - 1; j++)
+            parity[j] = parity[j + 1] ^ (generator[j + 1] ? gfExp[logFeedback + gfLog[generator[j + 1]]] : 0);
+        parity[nParity - 1] = gfExp[logFeedback + gfLog[generator[nParity]]];
+    }
+}
+
+// Syndromes S_i = r(alpha^i). Returns TRUE if they are all zero.
+static int computeSyndromes(const unsigned char *block, int size, int nParity, unsigned char *syndromes)
+{
+    int clean = TRUE;
+    for (int i = 0; i < nParity; i++)
+    {
+        unsigned char s = 0;
+        for (int p = 0; p < size; p++)
+            s = gfMul(s, gfExp[i]) ^ block[p];
+        syndromes[i] = s;
+        if (s != 0)
+            clean = FALSE;
+    }
+    return clean;
+}
+
+int rsDecode(unsigned char *block, int size, int nParity)
+{
+    pthread_once(&tablesOnce, buildTables);
+
+    unsigned char syndromes[MAX_FEC_PARITY];
+    if (computeSyndromes(block, size, nParity, syndromes))
+        return 0;
+
+    // Berlekamp-Massey: error locator lambda(x) = prod(1 - X_j x), lowest
+    // degree first, where X_j = alpha^k for an error at power k
+    unsigned char lambda[MAX_FEC_PARITY + 1] = {1};
+    unsigned char previous[MAX_FEC_PARITY + 1] = {1};
+    unsigned char saved[MAX_FEC_PARITY + 1];
+    int errors = 0;
+    int shift = 1;
+    unsigned char lastDiscrepancy = 1;
+
+    for (int n = 0; n < nParity; n++)
+    {
+        unsigned char d = syndromes[n];
+        for (int i = 1; i <= errors; i++)
+            d ^= gfMul(lambda[i], syndromes[n - i]);
+
+        if (d == 0)
+        {
+            shift++;
+            continue;
+        }
+
+        unsigned char scale = gfDiv(d, lastDiscrepancy);
+        if (2 * errors <= n)
+        {
+            memcpy(saved, lambda, sizeof(lambda));
+            for (int i = 0; i + shift <= nParity; i++)
+                lambda[i + shift] ^= gfMul(scale, previous[i]);
+            errors = n + 1 - errors;
+            memcpy(previous, saved, sizeof(previous));
+            lastDiscrepancy = d;
+            shift = 1;
+        }
+        else
+        {
+            for (int i = 0; i + shift <= nParity; i++)
+                lambda[i + shift] ^= gfMul(scale, previous[i]);
+            shift++;
+        }
+    }
+    if (2 * errors > nParity)
+        return -1;
+
+    // Error evaluator omega(x) = S(x) lambda(x) mod x^nParity
+    unsigned char omega[MAX_FEC_PARITY];
+    for (int i = 0; i < nParity; i++)
+    {
+        omega[i] = 0;
+        for (int j = 0; j <= i && j <= errors; j++)
+            omega[i] ^= gfMul(lambda[j], syndromes[i - j]);
+    }
+
+    // Chien search for the roots X_j^-1, then Forney for each magnitude
+    int found = 0;
+    for (int p = 0; p < size; p++)
+    {
+        int power = size - 1 - p;
+        unsigned char xInverse = gfPow(-power);
+
+        unsigned char value = 0;
+        for (int i = errors; i >= 0; i--)
+            value = gfMul(value, xInverse) ^ lambda[i];
+        if (value != 0)
+            continue;
+
+        // lambda'(x): only the odd powers survive in GF(2^8)
+        unsigned char derivative = 0;
+        for (int i = errors - (errors % 2 == 0); i >= 1; i -= 2)
+            derivative = gfMul(derivative, gfMul(xInverse, xInverse)) ^ lambda[i];
+        unsigned char evaluator = 0;
+        for (int i = nParity - 1; i >= 0; i--)
+            evaluator = gfMul(evaluator, xInverse) ^ omega[i];
+        if (derivative == 0)
+            return -1;
+
+        // e = X * omega(X^-1) / lambda'(X^-1)
+        block[p] ^= gfDiv(gfMul(gfPow(power), evaluator), derivative);
+        found++;
+    }
+    if (found != errors)
+        return -1;
+
+    // Beyond the correction capacity the result may still be wrong
+    if (!computeSyndromes(block, size, nParity, syndromes))
+        return -1;
+    return found;
+}
+
+int fecDecode(unsigned char *body, int size, int nParity, int *corrected)
+{
+    int in = 0;
+    int out = 0;
+
+    while (in < size)
+    {
+        int blockSize = size - in < FEC_BLOCK_SIZE ? size - in : FEC_BLOCK_SIZE;
+        if (blockSize <= nParity)
+            return -1;
+
+        int fixed = rsDecode(&body[in], blockSize, nParity);
+        if (fixed < 0)
+            return -1;
+        *corrected += fixed;
+
+        memmove(&body[out], &body[in], blockSize - nParity);
+        out += blockSize - nParity;
+        in += blockSize;
+    }
+    return out;
+}